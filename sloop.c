@@ -7,9 +7,37 @@
 #include <errno.h>
 #include <signal.h>
 #include <sys/sysinfo.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include "dlist.h"
 #include "sloop.h"
 #include "dtrace.h"
+#if SLOOP_WATCHDOG
+#include <pthread.h>
+#include <execinfo.h>
+#endif
+#if SLOOP_HANDOFF
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#if SLOOP_MIGRATE
+#include <stdint.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#endif
+#if SLOOP_RING
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#endif
+#if SLOOP_PIDFD
+#include <stdint.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
+#endif
 
 /********************************************************************/
 #if DEBUG_SLOOP
@@ -23,7 +51,23 @@
 #define SLOOP_TYPE_SOCKET	1
 #define SLOOP_TYPE_TIMEOUT	2
 #define SLOOP_TYPE_SIGNAL	3
+#define SLOOP_TYPE_CHILD	4
+#define SLOOP_TYPE_GROUP	5
+#define SLOOP_TYPE_OUTPUT	6
+#define SLOOP_TYPE_RING		7
 #define SLOOP_INUSED		0x0100
+#define SLOOP_LAZY			0x0200	/* timeout: 'lazy' holds a later deadline */
+#define SLOOP_WRITER		0x0400	/* socket: registered in writers */
+#define SLOOP_MIGRATED		0x0800	/* socket: handed to another loop, drop it */
+#define SLOOP_MEMBER_READ	0x1000	/* socket: group member, watch readable */
+#define SLOOP_MEMBER_WRITE	0x2000	/* socket: group member, watch writable */
+
+/* with loop migration every thread runs its own loop */
+#if SLOOP_MIGRATE
+#define SLOOP_LOCAL			__thread
+#else
+#define SLOOP_LOCAL
+#endif
 
 //记录一个待监听(读 or 写)套接字
 struct sloop_socket {
@@ -39,6 +83,7 @@ struct sloop_timeout {
 	struct dlist_head list;//双链表挂载点(不用时挂在free_timeout,使用时挂在timeout)
 	unsigned int flags;
 	struct timeval time;//超时时间
+	struct timeval lazy;//延后的超时时间(SLOOP_LAZY), 到期时再重新排队
 	void * param;
 	sloop_timeout_handler handler;//超时回调函数
 };
@@ -52,6 +97,114 @@ struct sloop_signal {
 	sloop_signal_handler handler;//信号回调函数
 };
 
+#if SLOOP_GROUP
+//记录一个批量回调组, 成员是挂在members上的sloop_socket
+struct sloop_group {
+	struct dlist_head list;//双链表挂载点(不用时挂在free_groups,使用时挂在groups)
+	unsigned int flags;
+	struct dlist_head members;
+	void * param;
+	sloop_batch_handler handler;//批量回调函数
+	struct sloop_event events[MAX_SLOOP_SOCKET];//每次循环就绪的成员
+};
+#endif
+
+#if SLOOP_OUTPUT
+//记录一个套接字的待发送数据, 每次循环结束时统一写出
+struct sloop_output {
+	struct dlist_head list;//双链表挂载点(不用时挂在free_outputs,使用时挂在outputs)
+	struct dlist_head dirty;//本次循环有新数据时挂在sloop.dirty上, 否则next为NULL
+	unsigned int flags;
+	int sock;
+	struct sloop_socket * wsock;//没有写完时注册的可写监听
+	unsigned int head;//环形缓冲写入位置
+	unsigned int tail;//环形缓冲写出位置
+	char buf[SLOOP_OUTPUT_SIZE];
+};
+#endif
+
+#if SLOOP_RING
+#define RING_SKIP			0xffffffff	/* record header: rest of the ring is unused, wrap */
+#define RING_ALIGN(x)		(((x) + 7) & ~7U)
+
+//共享内存里的环形队列, 生产者和消费者各写一个下标, 分开在不同的cache line
+struct sloop_ring_shm {
+	unsigned int size;//数据区大小, 2的幂
+	unsigned int pad0[15];
+	unsigned int head;//生产者写
+	unsigned int pad1[15];
+	unsigned int tail;//消费者写
+	unsigned int pad2[15];
+	char data[];//每条消息: 4字节长度 + 内容, 按8字节对齐
+};
+
+//记录一个共享内存通道
+struct sloop_ring {
+	struct dlist_head list;//双链表挂载点(不用时挂在free_rings,使用时挂在rings)
+	unsigned int flags;
+	int memfd;
+	int efd;//门铃, 消费者的loop监听它
+	struct sloop_ring_shm * shm;
+	size_t maplen;
+	unsigned int size;//创建/attach时从shm拷贝一次, 对端改了shm->size也不受影响
+	int broken;//共享内存里的下标或长度不对, 通道已停用
+	struct sloop_socket * sock;//sloop_ring_listen注册的eventfd
+	int held;//回调把当前消息留下了, 等sloop_ring_release
+	void * param;
+	sloop_ring_handler handler;//消息回调函数
+};
+#endif
+
+#if SLOOP_PIDFD
+//记录一个通过pidfd监视的子进程
+struct sloop_child {
+	struct dlist_head list;//双链表挂载点(不用时挂在free_children,使用时挂在children)
+	unsigned int flags;
+	int pid;
+	int pidfd;//挂在readers里, 子进程退出时可读
+	struct sloop_socket * sock;
+	void * param;
+	sloop_exit_handler handler;//子进程退出回调函数
+};
+#endif
+
+#if SLOOP_WATCHDOG
+#ifndef SLOOP_WATCHDOG_SIGNAL
+#define SLOOP_WATCHDOG_SIGNAL	SIGPROF	/* used to take the loop thread's backtrace, interrupts the handler */
+#endif
+
+//sloop_run当前正在执行的回调, 给watchdog线程看
+struct sloop_beat {
+	volatile unsigned long seq;//奇数表示正在执行回调
+	unsigned long iteration;//循环次数
+	int type;//SLOOP_STALL_xxx
+	int id;//fd or 信号值, 定时器为-1
+	void * handler;
+	void * param;
+	struct timeval start;//回调开始时间
+};
+#endif
+
+#if SLOOP_HANDOFF
+//监听套接字交接
+struct sloop_handoff {
+	char path[108];//交接用的unix socket路径
+	sloop_handoff_handler handler;//交接完成后的回调
+	void * param;
+	int count;//从旧进程接收到还没被认领的监听套接字
+	int fds[MAX_SLOOP_SOCKET];
+};
+#endif
+
+//虚拟时间模拟
+struct sloop_sim {
+	int enabled;
+	struct timeval now;//虚拟时钟
+	fd_set rfds;//注入的可读fd, 下一次select时送出
+	fd_set wfds;//注入的可写fd
+	int signals;//注入了还没送出的信号个数
+};
+
 struct sloop_data {
 	int terminate;//退出标志
 	int signal_pipe[2];//信号监听会使用到的管道
@@ -63,13 +216,61 @@ struct sloop_data {
 	struct dlist_head writers;
 	struct dlist_head signals;
 	struct dlist_head timeout;
+#if SLOOP_GROUP
+	struct dlist_head free_groups;
+	struct dlist_head groups;
+#endif
+#if SLOOP_OUTPUT
+	struct dlist_head free_outputs;
+	struct dlist_head outputs;
+	struct dlist_head dirty;//本次循环有新数据的sloop_output
+	struct sloop_output_stats output_stats;
+#endif
+#if SLOOP_RING
+	struct dlist_head free_rings;
+	struct dlist_head rings;
+#endif
+#if SLOOP_PIDFD
+	struct dlist_head free_children;
+	struct dlist_head children;
+#endif
+	struct timeval now;//最近一次select返回的时间
+	int dispatching;//sloop_run正在执行回调, now是有效的
+	struct sloop_sim sim;
+	unsigned int busy_budget;//busy-poll最大自旋时间(usecs), 0表示关闭
+	struct sloop_busy_poll_stats busy;
+#if SLOOP_WATCHDOG
+	struct sloop_beat beat;
+#endif
+#if SLOOP_MIGRATE
+	unsigned long busy_usecs;//执行回调花掉的总时间
+	unsigned long window_busy;//统计窗口开始时的busy_usecs
+	struct timeval window;//统计窗口开始时间
+	volatile unsigned long load;//上一个窗口每秒的busy usecs, 给其他loop看
+#endif
+#if SLOOP_HANDOFF
+	struct sloop_handoff handoff;
+#endif
 };
 
 //初始化静态存储区给sloop_***结构体
-static struct sloop_socket  _sloop_sockets[MAX_SLOOP_SOCKET];
-static struct sloop_timeout _sloop_timeout[MAX_SLOOP_TIMEOUT];
-static struct sloop_signal  _sloop_signals[MAX_SLOOP_SIGNAL];
-static struct sloop_data sloop;
+static SLOOP_LOCAL struct sloop_socket  _sloop_sockets[MAX_SLOOP_SOCKET];
+static SLOOP_LOCAL struct sloop_timeout _sloop_timeout[MAX_SLOOP_TIMEOUT];
+static SLOOP_LOCAL struct sloop_signal  _sloop_signals[MAX_SLOOP_SIGNAL];
+#if SLOOP_GROUP
+static SLOOP_LOCAL struct sloop_group   _sloop_groups[MAX_SLOOP_GROUP];
+#endif
+#if SLOOP_OUTPUT
+static SLOOP_LOCAL struct sloop_output  _sloop_outputs[MAX_SLOOP_OUTPUT];
+#endif
+#if SLOOP_RING
+static SLOOP_LOCAL struct sloop_ring    _sloop_rings[MAX_SLOOP_RING];
+#endif
+#if SLOOP_PIDFD
+static SLOOP_LOCAL struct sloop_child   _sloop_children[MAX_SLOOP_CHILD];
+#endif
+static SLOOP_LOCAL struct sloop_data sloop;
+static int signal_fds[NSIG];//每个信号写入注册它的loop的管道, 信号可能在任何线程上处理
 
 /* initialize list pools */
 static void init_list_pools(void)
@@ -82,6 +283,22 @@ static void init_list_pools(void)
 	for (i = 0; i < MAX_SLOOP_SOCKET;  i++)  dlist_add(&_sloop_sockets[i].list, &sloop.free_sockets);
 	for (i = 0; i < MAX_SLOOP_TIMEOUT; i++)  dlist_add(&_sloop_timeout[i].list, &sloop.free_timeout);
 	for (i = 0; i < MAX_SLOOP_SIGNAL;  i++)  dlist_add(&_sloop_signals[i].list, &sloop.free_signals);
+#if SLOOP_GROUP
+	memset(_sloop_groups, 0, sizeof(_sloop_groups));
+	for (i = 0; i < MAX_SLOOP_GROUP;   i++)  dlist_add(&_sloop_groups[i].list, &sloop.free_groups);
+#endif
+#if SLOOP_OUTPUT
+	memset(_sloop_outputs, 0, sizeof(_sloop_outputs));
+	for (i = 0; i < MAX_SLOOP_OUTPUT;  i++)  dlist_add(&_sloop_outputs[i].list, &sloop.free_outputs);
+#endif
+#if SLOOP_RING
+	memset(_sloop_rings, 0, sizeof(_sloop_rings));
+	for (i = 0; i < MAX_SLOOP_RING;    i++)  dlist_add(&_sloop_rings[i].list, &sloop.free_rings);
+#endif
+#if SLOOP_PIDFD
+	memset(_sloop_children, 0, sizeof(_sloop_children));
+	for (i = 0; i < MAX_SLOOP_CHILD;   i++)  dlist_add(&_sloop_children[i].list, &sloop.free_children);
+#endif
 }
 
 /* get socket from pool */
@@ -136,6 +353,82 @@ static struct sloop_signal * get_signal(void)
 	return target;
 }
 
+#if SLOOP_GROUP
+/* get group from pool */
+static struct sloop_group * get_group(void)
+{
+	struct dlist_head * entry;
+	struct sloop_group * target;
+
+	if (dlist_empty(&sloop.free_groups)) {
+		d_error("sloop: no sloop_group available !!!\n");
+		return NULL;
+	}
+	entry = sloop.free_groups.next;
+	dlist_del(entry);
+	target = dlist_entry(entry, struct sloop_group, list);
+	target->flags = SLOOP_INUSED | SLOOP_TYPE_GROUP;
+	return target;
+}
+#endif
+
+#if SLOOP_OUTPUT
+/* get output from pool */
+static struct sloop_output * get_output(void)
+{
+	struct dlist_head * entry;
+	struct sloop_output * target;
+
+	if (dlist_empty(&sloop.free_outputs)) {
+		d_error("sloop: no sloop_output available !!!\n");
+		return NULL;
+	}
+	entry = sloop.free_outputs.next;
+	dlist_del(entry);
+	target = dlist_entry(entry, struct sloop_output, list);
+	target->flags = SLOOP_INUSED | SLOOP_TYPE_OUTPUT;
+	return target;
+}
+#endif
+
+#if SLOOP_RING
+/* get ring from pool */
+static struct sloop_ring * get_ring(void)
+{
+	struct dlist_head * entry;
+	struct sloop_ring * target;
+
+	if (dlist_empty(&sloop.free_rings)) {
+		d_error("sloop: no sloop_ring available !!!\n");
+		return NULL;
+	}
+	entry = sloop.free_rings.next;
+	dlist_del(entry);
+	target = dlist_entry(entry, struct sloop_ring, list);
+	target->flags = SLOOP_INUSED | SLOOP_TYPE_RING;
+	return target;
+}
+#endif
+
+#if SLOOP_PIDFD
+/* get child from pool */
+static struct sloop_child * get_child(void)
+{
+	struct dlist_head * entry;
+	struct sloop_child * target;
+
+	if (dlist_empty(&sloop.free_children)) {
+		d_error("sloop: no sloop_child available !!!\n");
+		return NULL;
+	}
+	entry = sloop.free_children.next;
+	dlist_del(entry);
+	target = dlist_entry(entry, struct sloop_child, list);
+	target->flags = SLOOP_INUSED | SLOOP_TYPE_CHILD;
+	return target;
+}
+#endif
+
 /* return socket to pool */
 static void free_socket(struct sloop_socket * target)
 {
@@ -160,6 +453,46 @@ static void free_signal(struct sloop_signal * target)
 	dlist_add(&target->list, &sloop.free_signals);
 }
 
+#if SLOOP_GROUP
+/* return group to pool */
+static void free_group(struct sloop_group * target)
+{
+	dassert((target->flags & SLOOP_TYPE_MASK) == SLOOP_TYPE_GROUP);
+	target->flags &= (~SLOOP_INUSED);
+	dlist_add(&target->list, &sloop.free_groups);
+}
+#endif
+
+#if SLOOP_OUTPUT
+/* return output to pool */
+static void free_output(struct sloop_output * target)
+{
+	dassert((target->flags & SLOOP_TYPE_MASK) == SLOOP_TYPE_OUTPUT);
+	target->flags &= (~SLOOP_INUSED);
+	dlist_add(&target->list, &sloop.free_outputs);
+}
+#endif
+
+#if SLOOP_RING
+/* return ring to pool */
+static void free_ring(struct sloop_ring * target)
+{
+	dassert((target->flags & SLOOP_TYPE_MASK) == SLOOP_TYPE_RING);
+	target->flags &= (~SLOOP_INUSED);
+	dlist_add(&target->list, &sloop.free_rings);
+}
+#endif
+
+#if SLOOP_PIDFD
+/* return child to pool */
+static void free_child(struct sloop_child * target)
+{
+	dassert((target->flags & SLOOP_TYPE_MASK) == SLOOP_TYPE_CHILD);
+	target->flags &= (~SLOOP_INUSED);
+	dlist_add(&target->list, &sloop.free_children);
+}
+#endif
+
 /**********************************************************************/
 
 static struct sloop_socket * register_socket(int sock,
@@ -175,6 +508,7 @@ static struct sloop_socket * register_socket(int sock,
 	entry->sock = sock;
 	entry->param = param;
 	entry->handler = handler;
+	if (head == &sloop.writers) entry->flags |= SLOOP_WRITER;
 	dlist_add(&entry->list, head);
 	SLOOPDBG(d_dbg("sloop: new socket : 0x%x (fd=%d)\n", (unsigned int)entry, entry->sock));
 	return entry;
@@ -203,11 +537,352 @@ static void cancel_socket(struct sloop_socket * target, struct dlist_head * head
 static void sloop_signals_handler(int sig)
 {
 	d_info("sloop: sloop_signals_handler(%d)\n", sig);
-	if (write(sloop.signal_pipe[1], &sig, sizeof(sig)) < 0) {
+	if (sig <= 0 || sig >= NSIG || write(signal_fds[sig], &sig, sizeof(sig)) < 0) {
 		d_error("sloop: sloop_signals_handler(): Cound not send signal: %s\n", strerror(errno));
 	}
 }
 
+/* loop clock: wall time, or the virtual clock in simulation mode */
+static void sloop_gettime(struct timeval * tv)
+{
+	if (sloop.sim.enabled)
+		*tv = sloop.sim.now;
+	else
+		gettimeofday(tv, NULL);
+}
+
+/* select() against the injected readiness: report injected fds the loop
+ * waits on, otherwise jump the virtual clock straight to the timeout. */
+static int sim_select(int nfds, fd_set * rfds, fd_set * wfds, struct timeval * tv)
+{
+	fd_set r, w;
+	int fd, n = 0;
+
+	FD_ZERO(&r);
+	FD_ZERO(&w);
+	for (fd = 0; fd < nfds; fd++) {
+		if (fd == sloop.signal_pipe[0]) {
+			if (sloop.sim.signals > 0 && FD_ISSET(fd, rfds)) {
+				FD_SET(fd, &r);
+				sloop.sim.signals--;
+				n++;
+			}
+			continue;
+		}
+		if (FD_ISSET(fd, rfds) && FD_ISSET(fd, &sloop.sim.rfds)) {
+			FD_CLR(fd, &sloop.sim.rfds);
+			FD_SET(fd, &r);
+			n++;
+		}
+		if (FD_ISSET(fd, wfds) && FD_ISSET(fd, &sloop.sim.wfds)) {
+			FD_CLR(fd, &sloop.sim.wfds);
+			FD_SET(fd, &w);
+			n++;
+		}
+	}
+	*rfds = r;
+	*wfds = w;
+
+	if (n == 0) {
+		if (tv) {
+			timeradd(&sloop.sim.now, tv, &sloop.sim.now);
+		} else {
+			/* 没有定时器也没有注入的事件, 再也不会有事情发生, 模拟结束 */
+			SLOOPDBG(d_info("sloop: simulation is idle, terminate !!\n"));
+			sloop.terminate = 1;
+		}
+	}
+	return n;
+}
+
+static int sloop_select(int nfds, fd_set * rfds, fd_set * wfds, struct timeval * tv)
+{
+	if (sloop.sim.enabled)
+		return sim_select(nfds, rfds, wfds, tv);
+	return select(nfds, rfds, wfds, NULL, tv);
+}
+
+/* deadline = base + secs/usecs */
+static void set_deadline(struct timeval * tv, const struct timeval * base, unsigned int secs, unsigned int usecs)
+{
+	tv->tv_sec = base->tv_sec + secs;
+	tv->tv_usec = base->tv_usec + usecs;
+	while (tv->tv_usec >= 1000000) {
+		tv->tv_sec++;
+		tv->tv_usec -= 1000000;
+	}
+}
+
+/* put the timer into the sorted timeout list */
+static void insert_timeout(struct sloop_timeout * timeout)
+{
+	struct sloop_timeout * tmp;
+	struct dlist_head * entry;
+
+	entry = sloop.timeout.next;
+	while (entry != &sloop.timeout) {
+		tmp = dlist_entry(entry, struct sloop_timeout, list);
+		if (timercmp(&timeout->time, &tmp->time, < )) break;
+		entry = entry->next;
+	}
+	dlist_add_tail(&timeout->list, entry);
+	SLOOPDBG(d_dbg("sloop: timeout(0x%x) added !!\n", timeout));
+}
+
+#if SLOOP_OUTPUT
+/* write out everything queued with one writev().
+ * Returns 0 when the queue is empty, 1 if some is left, -1 on error. */
+static int output_flush(struct sloop_output * out)
+{
+	struct iovec iov[2];
+	unsigned int len, pos, first;
+	int cnt, res;
+
+	len = out->head - out->tail;
+	if (len == 0) return 0;
+
+	/* 环形缓冲绕回时分两段 */
+	pos = out->tail & (SLOOP_OUTPUT_SIZE - 1);
+	first = SLOOP_OUTPUT_SIZE - pos;
+	if (first > len) first = len;
+	iov[0].iov_base = out->buf + pos;
+	iov[0].iov_len = first;
+	iov[1].iov_base = out->buf;
+	iov[1].iov_len = len - first;
+	cnt = (len > first) ? 2 : 1;
+
+	res = writev(out->sock, iov, cnt);
+	sloop.output_stats.syscalls++;
+	if (res < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 1;
+		d_error("sloop: output fd=%d writev error %s, %u bytes dropped\n", out->sock, strerror(errno), len);
+		out->tail = out->head;
+		return -1;
+	}
+	out->tail += res;
+	return (out->head != out->tail) ? 1 : 0;
+}
+
+/* socket writable again after a partial flush */
+static int output_writable(int sock, void * param, void * sloop_data)
+{
+	struct sloop_output * out = (struct sloop_output *)param;
+
+	if (output_flush(out) > 0) return 0;
+	out->wsock = NULL;
+	return -1;//写完了, 不再监听可写
+}
+#endif
+
+/* time left until the timer expires, zero if it already has */
+static void timeout_left(struct sloop_timeout * timeout, struct timeval * tv)
+{
+	struct timeval now;
+
+	sloop_gettime(&now);
+	if (timercmp(&now, &timeout->time, >= ))
+		tv->tv_sec = tv->tv_usec = 0;
+	else
+		timersub(&timeout->time, &now, tv);
+}
+
+/* spin on a zero-timeout select() for up to the current spin window,
+ * never past the next timer. On a hit the ready sets are copied back
+ * to the caller, otherwise they are left untouched for the blocking select(). */
+static int busy_poll(int nfds, fd_set * rfds, fd_set * wfds, struct timeval * deadline)
+{
+	fd_set r, w;
+	struct timeval start, now, end, zero;
+	int res, cut = 0;
+
+	gettimeofday(&start, NULL);
+	end.tv_sec = start.tv_sec;
+	end.tv_usec = start.tv_usec + sloop.busy.window;
+	while (end.tv_usec >= 1000000) {
+		end.tv_sec++;
+		end.tv_usec -= 1000000;
+	}
+	if (deadline && timercmp(deadline, &end, < )) {
+		end = *deadline;
+		cut = 1;
+	}
+
+	do {
+		r = *rfds;
+		w = *wfds;
+		zero.tv_sec = zero.tv_usec = 0;
+		res = select(nfds, &r, &w, NULL, &zero);
+		sloop.busy.polls++;
+		gettimeofday(&now, NULL);
+	} while (res == 0 && timercmp(&now, &end, < ));
+
+	timersub(&now, &start, &end);
+	sloop.busy.spin_usecs += end.tv_sec * 1000000 + end.tv_usec;
+
+	if (res > 0) {
+		*rfds = r;
+		*wfds = w;
+		sloop.busy.hits++;
+		/* 有事件到来, 自旋窗口向预算值放大 */
+		sloop.busy.window <<= 1;
+		if (sloop.busy.window > sloop.busy_budget) sloop.busy.window = sloop.busy_budget;
+	} else if (res == 0) {
+		sloop.busy.misses++;
+		/* 空转, 缩小自旋窗口; 被定时器截断的窗口不算空转 */
+		if (!cut) {
+			sloop.busy.window >>= 1;
+			if (sloop.busy.window < SLOOP_BUSY_POLL_MIN)
+				sloop.busy.window = sloop.busy_budget < SLOOP_BUSY_POLL_MIN ? sloop.busy_budget : SLOOP_BUSY_POLL_MIN;
+		}
+	}
+	return res;
+}
+
+#if SLOOP_WATCHDOG
+/* watchdog state, shared between the loop and the watchdog thread */
+static struct {
+	pthread_t thread;
+	pthread_t loop;//sloop_run所在线程
+	pthread_mutex_t lock;
+	volatile int running;
+	unsigned long threshold;//usecs
+	int backtrace;
+	struct sloop_beat * beat;
+	unsigned long last_seq;//最近一次报告的回调
+	unsigned int count;//记录过的卡顿总数, log[count % MAX_SLOOP_STALL]是下一个
+	struct sloop_stall * volatile capture;//等待抓取backtrace的记录
+	volatile unsigned long capture_seq;//卡住的那次回调的seq
+	struct sloop_stall log[MAX_SLOOP_STALL];
+} wd = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void beat_enter(int type, int id, void * handler, void * param)
+{
+	sloop.beat.type = type;
+	sloop.beat.id = id;
+	sloop.beat.handler = handler;
+	sloop.beat.param = param;
+	gettimeofday(&sloop.beat.start, NULL);
+	__sync_synchronize();
+	sloop.beat.seq++;
+}
+
+static void beat_leave(void)
+{
+	__sync_synchronize();
+	sloop.beat.seq++;
+}
+
+#define BEAT_ENTER(t, i, h, p)	beat_enter(t, i, (void *)(h), p)
+#define BEAT_LEAVE()			beat_leave()
+#else
+#define BEAT_ENTER(t, i, h, p)
+#define BEAT_LEAVE()
+#endif
+
+#if SLOOP_MIGRATE
+//loop之间移交的一个套接字
+struct sloop_migration {
+	int sock;
+	int write;//1: 挂到writers
+	sloop_socket_handler handler;
+	void * param;
+};
+
+//loop之间的单生产者单消费者通道, 由目的loop打开
+struct sloop_channel {
+	volatile int inuse;//0空闲, 1使用中, 2已关闭(不再复用, 旧handle只会失败)
+	volatile int users;//正在sloop_migrate里使用通道的生产者
+	int efd;//eventfd, 挂在目的loop的readers里
+	struct sloop_data * volatile dst;//目的loop, NULL表示正在关闭, 不再接收
+	struct sloop_socket * sock;
+	unsigned int head;//生产者(源loop)写
+	char pad[64];
+	unsigned int tail;//消费者(目的loop)写
+	struct sloop_migration ring[SLOOP_CHANNEL_SIZE];
+};
+
+static struct sloop_channel _sloop_channels[MAX_SLOOP_CHANNEL];
+
+/* add one iteration's handler time to the loop's busy counters and
+ * publish the busy usecs per second once a second. */
+static void account_busy(struct timeval * start)
+{
+	struct timeval now, tv;
+	unsigned long span;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, start, &tv);
+	sloop.busy_usecs += tv.tv_sec * 1000000 + tv.tv_usec;
+
+	timersub(&now, &sloop.window, &tv);
+	if (tv.tv_sec < 1) return;
+	span = tv.tv_sec * 1000000 + tv.tv_usec;
+	sloop.load = (unsigned long)((unsigned long long)(sloop.busy_usecs - sloop.window_busy) * 1000000 / span);
+	sloop.window_busy = sloop.busy_usecs;
+	sloop.window = now;
+}
+
+/* destination side: register every socket waiting in the ring here,
+ * or close them when the loop is going away ('adopt' == 0) */
+static void drain_channel(struct sloop_channel * ch, int adopt)
+{
+	struct sloop_migration * m;
+	unsigned int tail, head;
+
+	tail = ch->tail;
+	head = __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE);
+	while (tail != head) {
+		m = &ch->ring[tail & (SLOOP_CHANNEL_SIZE - 1)];
+		if (!adopt) {
+			/* 目的loop要退出了, 没有人会再处理它 */
+			d_error("sloop: loop is exiting, migrated fd=%d closed !!!\n", m->sock);
+			close(m->sock);
+		} else if (register_socket(m->sock, m->handler, m->param, m->write ? &sloop.writers : &sloop.readers) == NULL) {
+			/* 放不下了, 只能关掉, 否则对端永远等不到回应 */
+			d_error("sloop: can not adopt migrated fd=%d, closed !!!\n", m->sock);
+			close(m->sock);
+		}
+		tail++;
+	}
+	__atomic_store_n(&ch->tail, tail, __ATOMIC_RELEASE);
+}
+
+static int channel_handler(int sock, void * param, void * sloop_data)
+{
+	uint64_t count;
+
+	if (read(sock, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		d_error("sloop: channel read error %s\n", strerror(errno));
+	drain_channel((struct sloop_channel *)param, 1);
+	return 0;
+}
+
+static void close_channel(struct sloop_channel * ch, int adopt)
+{
+	/* 先拒绝新的生产者, 再等已经在sloop_migrate里的生产者出来 */
+	__atomic_store_n(&ch->dst, NULL, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&ch->users, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	drain_channel(ch, adopt);
+	if (ch->sock) cancel_socket(ch->sock, &sloop.readers);
+	ch->sock = NULL;
+	close(ch->efd);
+	/* 不放回空闲: 别的线程手里可能还有这个handle */
+	__atomic_store_n(&ch->inuse, 2, __ATOMIC_RELEASE);
+}
+
+/* sloop_run is leaving: close the channels into this loop */
+static void close_channels(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_SLOOP_CHANNEL; i++)
+		if (_sloop_channels[i].inuse == 1 && _sloop_channels[i].dst == &sloop)
+			close_channel(&_sloop_channels[i], 0);
+}
+#endif
+
 /***************************************************************************/
 /* sloop APIs */
 
@@ -222,6 +897,23 @@ void sloop_init(void * sloop_data)
 	INIT_DLIST_HEAD(&sloop.free_sockets);
 	INIT_DLIST_HEAD(&sloop.free_timeout);
 	INIT_DLIST_HEAD(&sloop.free_signals);
+#if SLOOP_GROUP
+	INIT_DLIST_HEAD(&sloop.groups);
+	INIT_DLIST_HEAD(&sloop.free_groups);
+#endif
+#if SLOOP_OUTPUT
+	INIT_DLIST_HEAD(&sloop.outputs);
+	INIT_DLIST_HEAD(&sloop.free_outputs);
+	INIT_DLIST_HEAD(&sloop.dirty);
+#endif
+#if SLOOP_RING
+	INIT_DLIST_HEAD(&sloop.rings);
+	INIT_DLIST_HEAD(&sloop.free_rings);
+#endif
+#if SLOOP_PIDFD
+	INIT_DLIST_HEAD(&sloop.children);
+	INIT_DLIST_HEAD(&sloop.free_children);
+#endif
 	init_list_pools();
 	pipe(sloop.signal_pipe);
 	sloop.sloop_data = sloop_data;
@@ -251,54 +943,198 @@ void sloop_cancel_write_sock(sloop_handle handle)
 	cancel_socket((struct sloop_socket *)handle, &sloop.writers);
 }
 
-/* register a signal handler */
-sloop_handle sloop_register_signal(int sig, sloop_signal_handler handler, void * param)
+#if SLOOP_GROUP
+/* register a batch handler: every loop iteration it gets all of the
+ * group's ready members in one array. Members are added with
+ * sloop_group_add(); returning < 0 from the handler cancels the group. */
+sloop_handle sloop_register_group(sloop_batch_handler handler, void * param)
 {
-	struct sloop_signal * entry;
-	struct sigaction sa;
+	struct sloop_group * group;
 
-	sa.sa_handler = sloop_signals_handler;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = SA_RESTART;
+	group = get_group();
+	if (group == NULL) return NULL;
 
-	/* allocate a new structure sloop_signal */
-	entry = get_signal();
-	if (entry == NULL)
-		return NULL;
+	INIT_DLIST_HEAD(&group->members);
+	group->handler = handler;
+	group->param = param;
+	dlist_add_tail(&group->list, &sloop.groups);
+	SLOOPDBG(d_dbg("sloop: new group : 0x%x\n", (unsigned int)group));
+	return group;
+}
 
-	/* setup structure and insert into list. */
-	entry->sig = sig;
-	entry->param = param;
-	entry->handler = handler;
-	dlist_add(&entry->list, &sloop.signals);
-	SLOOPDBG(d_dbg("sloop: sloop_register_signal(%d)\n", sig));
-	if (sigaction(sig, &sa, NULL) < 0) {
-		dlist_del(&entry->list);
-		free_signal(entry);
-		d_error("sigaction %d error %s\n", sig, strerror(errno));
-		return NULL;
-	}
+/* watch 'sock' for SLOOP_EVENT_READ and/or SLOOP_EVENT_WRITE as a member of 'group' */
+sloop_handle sloop_group_add(sloop_handle group, int sock, int events, void * param)
+{
+	struct sloop_socket * entry;
 
+	if (!(events & (SLOOP_EVENT_READ | SLOOP_EVENT_WRITE))) return NULL;
+	entry = register_socket(sock, NULL, param, &((struct sloop_group *)group)->members);
+	if (entry == NULL) return NULL;
+	if (events & SLOOP_EVENT_READ)  entry->flags |= SLOOP_MEMBER_READ;
+	if (events & SLOOP_EVENT_WRITE) entry->flags |= SLOOP_MEMBER_WRITE;
 	return entry;
 }
 
-/* cancel a signal handler */
-void sloop_cancel_signal(sloop_handle handle)
+/* remove a member, also allowed from the group's batch handler */
+void sloop_group_del(sloop_handle member)
 {
-	struct sloop_signal * entry = (struct sloop_signal *)handle;
-	struct dlist_head * list;
+	cancel_socket((struct sloop_socket *)member, NULL);
+}
+
+/* cancel a group with all its members */
+void sloop_cancel_group(sloop_handle handle)
+{
+	struct sloop_group * group = (struct sloop_group *)handle;
 
 	if (handle) {
-		SLOOPDBG(d_dbg("sloop: sloop_cancel_signal(%d)\n", entry->sig));
-		signal(entry->sig, SIG_DFL);
-		dlist_del(&entry->list);
-		free_signal(entry);
+		cancel_socket(NULL, &group->members);
+		dlist_del(&group->list);
+		SLOOPDBG(d_dbg("sloop: free group : 0x%x\n", (unsigned int)group));
+		free_group(group);
 	} else {
-		while (!dlist_empty(&sloop.signals)) {
-			list = sloop.signals.next;
-			entry = dlist_entry(list, struct sloop_signal, list);
-			SLOOPDBG(d_dbg("sloop: sloop_cancel_signal(%d)\n", entry->sig));
-			signal(entry->sig, SIG_DFL);
+		while (!dlist_empty(&sloop.groups))
+			sloop_cancel_group(dlist_entry(sloop.groups.next, struct sloop_group, list));
+	}
+}
+#endif
+
+#if SLOOP_OUTPUT
+/* attach a pending-output queue to 'sock'. Data appended with
+ * sloop_output_write() is written once per loop iteration, after all
+ * handlers ran, and write interest is only registered when that write
+ * was partial. 'sock' is switched to O_NONBLOCK so a full send buffer
+ * never blocks the loop; the caller's own read()/write() on it must
+ * handle EAGAIN from then on. */
+sloop_handle sloop_output_open(int sock)
+{
+	struct sloop_output * out;
+	int fl;
+
+	fl = fcntl(sock, F_GETFL);
+	if (fl < 0 || (!(fl & O_NONBLOCK) && fcntl(sock, F_SETFL, fl | O_NONBLOCK) < 0)) {
+		d_error("sloop: can not set fd=%d non-blocking: %s\n", sock, strerror(errno));
+		return NULL;
+	}
+
+	out = get_output();
+	if (out == NULL) return NULL;
+
+	out->sock = sock;
+	out->wsock = NULL;
+	out->head = out->tail = 0;
+	out->dirty.next = out->dirty.prev = NULL;
+	dlist_add(&out->list, &sloop.outputs);
+	return out;
+}
+
+/* queue 'len' bytes for 'out'; returns len, or -1 with EMSGSIZE if they
+ * can never fit and EAGAIN if the queue is too full right now */
+int sloop_output_write(sloop_handle handle, const void * buf, unsigned int len)
+{
+	struct sloop_output * out = (struct sloop_output *)handle;
+	unsigned int pos, first;
+
+	if (len > SLOOP_OUTPUT_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (len > SLOOP_OUTPUT_SIZE - (out->head - out->tail)) {
+		/* 放不下, 先把已有的写出去 */
+		output_flush(out);
+		if (len > SLOOP_OUTPUT_SIZE - (out->head - out->tail)) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	pos = out->head & (SLOOP_OUTPUT_SIZE - 1);
+	first = SLOOP_OUTPUT_SIZE - pos;
+	if (first > len) first = len;
+	memcpy(out->buf + pos, buf, first);
+	memcpy(out->buf, (const char *)buf + first, len - first);
+	out->head += len;
+	sloop.output_stats.writes++;
+
+	/* 等可写时由output_writable写出, 否则本次循环结束时写 */
+	if (out->wsock == NULL && out->dirty.next == NULL)
+		dlist_add_tail(&out->dirty, &sloop.dirty);
+	return len;
+}
+
+/* write out what is queued (best effort) and release the queue, NULL for all */
+void sloop_output_close(sloop_handle handle)
+{
+	struct sloop_output * out = (struct sloop_output *)handle;
+
+	if (handle) {
+		output_flush(out);
+		if (out->wsock) cancel_socket(out->wsock, &sloop.writers);
+		if (out->dirty.next) dlist_del(&out->dirty);
+		dlist_del(&out->list);
+		free_output(out);
+	} else {
+		while (!dlist_empty(&sloop.outputs))
+			sloop_output_close(dlist_entry(sloop.outputs.next, struct sloop_output, list));
+	}
+}
+
+void sloop_get_output_stats(struct sloop_output_stats * stats)
+{
+	*stats = sloop.output_stats;
+	stats->saved = (stats->writes > stats->syscalls) ? stats->writes - stats->syscalls : 0;
+}
+#endif
+
+/* register a signal handler */
+sloop_handle sloop_register_signal(int sig, sloop_signal_handler handler, void * param)
+{
+	struct sloop_signal * entry;
+	struct sigaction sa;
+
+	if (sig <= 0 || sig >= NSIG) return NULL;
+	signal_fds[sig] = sloop.signal_pipe[1];
+	sa.sa_handler = sloop_signals_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+
+	/* allocate a new structure sloop_signal */
+	entry = get_signal();
+	if (entry == NULL)
+		return NULL;
+
+	/* setup structure and insert into list. */
+	entry->sig = sig;
+	entry->param = param;
+	entry->handler = handler;
+	dlist_add(&entry->list, &sloop.signals);
+	SLOOPDBG(d_dbg("sloop: sloop_register_signal(%d)\n", sig));
+	if (sigaction(sig, &sa, NULL) < 0) {
+		dlist_del(&entry->list);
+		free_signal(entry);
+		d_error("sigaction %d error %s\n", sig, strerror(errno));
+		return NULL;
+	}
+
+	return entry;
+}
+
+/* cancel a signal handler */
+void sloop_cancel_signal(sloop_handle handle)
+{
+	struct sloop_signal * entry = (struct sloop_signal *)handle;
+	struct dlist_head * list;
+
+	if (handle) {
+		SLOOPDBG(d_dbg("sloop: sloop_cancel_signal(%d)\n", entry->sig));
+		signal(entry->sig, SIG_DFL);
+		dlist_del(&entry->list);
+		free_signal(entry);
+	} else {
+		while (!dlist_empty(&sloop.signals)) {
+			list = sloop.signals.next;
+			entry = dlist_entry(list, struct sloop_signal, list);
+			SLOOPDBG(d_dbg("sloop: sloop_cancel_signal(%d)\n", entry->sig));
+			signal(entry->sig, SIG_DFL);
 			dlist_del(list);
 			free_signal(entry);
 		}
@@ -309,44 +1145,65 @@ void sloop_cancel_signal(sloop_handle handle)
 /* register a timer  */
 sloop_handle sloop_register_timeout(unsigned int secs, unsigned int usecs, sloop_timeout_handler handler, void * param)
 {
-	struct sloop_timeout * timeout, * tmp;
-	struct dlist_head * entry;
+	struct sloop_timeout * timeout;
+	struct timeval now;
 
 	/* allocate a new struct sloop_timeout. */
 	timeout = get_timeout();
 	if (timeout == NULL) return NULL;
 
 	/* get current time */
-	gettimeofday(&timeout->time, NULL);
-	timeout->time.tv_sec += secs;
-	timeout->time.tv_usec += usecs;
-
-	while (timeout->time.tv_usec >= 1000000) {
-		timeout->time.tv_sec++;
-		timeout->time.tv_usec -= 1000000;
-	}
+	sloop_gettime(&now);
+	set_deadline(&timeout->time, &now, secs, usecs);
 	timeout->handler = handler;
 	timeout->param = param;
-	INIT_DLIST_HEAD(&timeout->list);
 
 	/* put into the list */
-	if (dlist_empty(&sloop.timeout)) {
-		dlist_add(&timeout->list, &sloop.timeout);
-		SLOOPDBG(d_dbg("sloop: timeout(0x%x) added !\n", timeout));
-		return timeout;
-	}
-
-	entry = sloop.timeout.next;
-	while (entry != &sloop.timeout) {
-		tmp = dlist_entry(entry, struct sloop_timeout, list);
-		if (timercmp(&timeout->time, &tmp->time, < )) break;
-		entry = entry->next;
-	}
-	dlist_add_tail(&timeout->list, entry);
-	SLOOPDBG(d_dbg("sloop: timeout(0x%x) added !!\n", timeout));
+	insert_timeout(timeout);
 	return timeout;
 }
 
+/* move a pending timer to now + secs/usecs, reusing its node.
+ * May also be called from the timer's own handler to re-arm it. */
+int sloop_timer_reset(sloop_handle handle, unsigned int secs, unsigned int usecs)
+{
+	struct sloop_timeout * timeout = (struct sloop_timeout *)handle;
+	struct timeval now;
+
+	if (timeout == NULL || !(timeout->flags & SLOOP_INUSED)) return -1;
+
+	/* list.next == NULL: 定时器正在执行回调, 已经不在链表里 */
+	if (timeout->list.next) dlist_del(&timeout->list);
+	timeout->flags &= (~SLOOP_LAZY);
+	sloop_gettime(&now);
+	set_deadline(&timeout->time, &now, secs, usecs);
+	insert_timeout(timeout);
+	return 0;
+}
+
+/* push a pending timer to now + secs/usecs without touching the list.
+ * The new deadline is only applied when the old one expires; inside
+ * handlers it is taken from the loop's cached time, elsewhere from the
+ * clock. Moving a timer earlier falls back to sloop_timer_reset(). */
+int sloop_timer_reset_lazy(sloop_handle handle, unsigned int secs, unsigned int usecs)
+{
+	struct sloop_timeout * timeout = (struct sloop_timeout *)handle;
+	struct timeval now;
+
+	if (timeout == NULL || !(timeout->flags & SLOOP_INUSED)) return -1;
+
+	/* 只有在回调里sloop.now才是当前时间 */
+	if (sloop.dispatching)
+		now = sloop.now;
+	else
+		sloop_gettime(&now);
+	set_deadline(&timeout->lazy, &now, secs, usecs);
+	if (timeout->list.next == NULL || timercmp(&timeout->lazy, &timeout->time, < ))
+		return sloop_timer_reset(handle, secs, usecs);
+	timeout->flags |= SLOOP_LAZY;
+	return 0;
+}
+
 /* cancel the timer */
 void sloop_cancel_timeout(sloop_handle handle)
 {
@@ -354,7 +1211,8 @@ void sloop_cancel_timeout(sloop_handle handle)
 	struct dlist_head * list;
 
 	if (handle) {
-		dlist_del(&(entry->list));
+		/* 在自己的回调里取消时已经不在链表里 */
+		if (entry->list.next) dlist_del(&(entry->list));
 		SLOOPDBG(d_dbg("sloop: sloop_cancel_timeout(0x%x)\n", handle));
 		free_timeout(entry);
 	} else {
@@ -372,16 +1230,31 @@ void sloop_run(void)
 {
 	fd_set rfds;
 	fd_set wfds;
-	struct timeval tv, now;
+	struct timeval tv;
 	struct sloop_timeout * entry_timeout = NULL;
 	struct sloop_socket * entry_socket;
 	struct sloop_signal * entry_signal;
 	struct dlist_head * entry;
 	int max_sock;
 	int res;
+	int ret;
 	int sig;
+#if SLOOP_GROUP
+	struct sloop_group * entry_group;
+	struct dlist_head * member;
+	int count;
+#endif
+#if SLOOP_OUTPUT
+	struct sloop_output * entry_output;
+#endif
+#if SLOOP_MIGRATE
+	struct timeval busy;
+#endif
 	// 开始循环
 	while (!sloop.terminate) {
+#if SLOOP_WATCHDOG
+		sloop.beat.iteration++;
+#endif
 		/* 是否有定时器加入 */
 		if (!dlist_empty(&sloop.timeout)) {
 			entry = sloop.timeout.next;
@@ -389,16 +1262,9 @@ void sloop_run(void)
 		} else {
 			entry_timeout = NULL;
 		}
-		/* 有定时器 */
-		if (entry_timeout) {
-			/* 获取当前时间 */
-			gettimeofday(&now, NULL);
-			/* 当前时间>=定时器表示应该执行定时器的回调函数了 */
-			if (timercmp(&now, &entry_timeout->time, >= ))
-				tv.tv_sec = tv.tv_usec = 0;/* tv是select函数的timeout，直接置0表示不阻塞 */
-			else
-				timersub(&entry_timeout->time, &now, &tv);/* 否则阻塞 '当前时间-到期时间' */
-		}
+		/* 有定时器: tv是select函数的timeout, 已到期则置0表示不阻塞, 否则阻塞到到期时间 */
+		if (entry_timeout)
+			timeout_left(entry_timeout, &tv);
 
 		/* 清空读写描述符集合 */
 		FD_ZERO(&rfds);
@@ -412,18 +1278,49 @@ void sloop_run(void)
 		/* 添加套接字可读转状态 */
 		for (entry = sloop.readers.next; entry != &sloop.readers; entry = entry->next) {
 			entry_socket = dlist_entry(entry, struct sloop_socket, list);
+			if (entry_socket->flags & SLOOP_MIGRATED) continue;
 			FD_SET(entry_socket->sock, &rfds);
 			if (max_sock < entry_socket->sock) max_sock = entry_socket->sock;
 		}
 		/* 添加套接字可写转状态 */
 		for (entry = sloop.writers.next; entry != &sloop.writers; entry = entry->next) {
 			entry_socket = dlist_entry(entry, struct sloop_socket, list);
+			if (entry_socket->flags & SLOOP_MIGRATED) continue;
 			FD_SET(entry_socket->sock, &wfds);
 			if (max_sock < entry_socket->sock) max_sock = entry_socket->sock;
 		}
 
-		d_dbg("sloop: >>> enter select sloop !!\n");
-		res = select(max_sock + 1, &rfds, &wfds, NULL, entry_timeout ? &tv : NULL);
+#if SLOOP_GROUP
+		/* 添加批量回调组成员 */
+		for (entry = sloop.groups.next; entry != &sloop.groups; entry = entry->next) {
+			entry_group = dlist_entry(entry, struct sloop_group, list);
+			for (member = entry_group->members.next; member != &entry_group->members; member = member->next) {
+				entry_socket = dlist_entry(member, struct sloop_socket, list);
+				if (entry_socket->flags & SLOOP_MEMBER_READ)  FD_SET(entry_socket->sock, &rfds);
+				if (entry_socket->flags & SLOOP_MEMBER_WRITE) FD_SET(entry_socket->sock, &wfds);
+				if (max_sock < entry_socket->sock) max_sock = entry_socket->sock;
+			}
+		}
+#endif
+
+		/* busy-poll模式: 先自旋一段时间, 没有事件再阻塞 */
+		sloop.dispatching = 0;
+		res = 0;
+		if (sloop.busy_budget && !sloop.sim.enabled) {
+			res = busy_poll(max_sock + 1, &rfds, &wfds, entry_timeout ? &entry_timeout->time : NULL);
+			if (res == 0 && entry_timeout)
+				timeout_left(entry_timeout, &tv);
+		}
+
+		if (res == 0) {
+			d_dbg("sloop: >>> enter select sloop !!\n");
+			res = sloop_select(max_sock + 1, &rfds, &wfds, entry_timeout ? &tv : NULL);
+		}
+		sloop_gettime(&sloop.now);
+		sloop.dispatching = 1;
+#if SLOOP_MIGRATE
+		gettimeofday(&busy, NULL);
+#endif
 
 		if (res < 0) {
 			/* 意外被中断 */
@@ -448,7 +1345,10 @@ void sloop_run(void)
 					entry_signal = dlist_entry(entry, struct sloop_signal, list);
 					/* 通过信号值找到登记的信号结构体并执行回调函数 */
 					if (entry_signal->sig == sig) {
-						if (entry_signal->handler(entry_signal->sig, entry_signal->param, sloop.sloop_data) < 0) {
+						BEAT_ENTER(SLOOP_STALL_SIGNAL, sig, entry_signal->handler, entry_signal->param);
+						ret = entry_signal->handler(entry_signal->sig, entry_signal->param, sloop.sloop_data);
+						BEAT_LEAVE();
+						if (ret < 0) {
 							dlist_del(entry);
 							free_signal(entry_signal);
 						}
@@ -464,13 +1364,24 @@ void sloop_run(void)
 		/* 检查定时器 */
 		if (entry_timeout) {
 			if (sloop.timeout.next == &entry_timeout->list) {
-				gettimeofday(&now, NULL);
-				if (res == 0 || timercmp(&now, &entry_timeout->time, >= )) {
-					/* 当前时间>=到期时间就调用回调函数 */
-					if (entry_timeout->handler)
-						entry_timeout->handler(entry_timeout->param, sloop.sloop_data);
+				if (res == 0 || timercmp(&sloop.now, &entry_timeout->time, >= )) {
 					dlist_del(&entry_timeout->list);//删除了定时器
-					free_timeout(entry_timeout);//将此定时器又归还给free_timeout双链表
+					if ((entry_timeout->flags & SLOOP_LAZY) && timercmp(&entry_timeout->lazy, &sloop.now, > )) {
+						/* 期间被延后过, 按新的到期时间重新排队 */
+						entry_timeout->flags &= (~SLOOP_LAZY);
+						entry_timeout->time = entry_timeout->lazy;
+						insert_timeout(entry_timeout);
+					} else {
+						/* 当前时间>=到期时间就调用回调函数 */
+						if (entry_timeout->handler) {
+							BEAT_ENTER(SLOOP_STALL_TIMEOUT, -1, entry_timeout->handler, entry_timeout->param);
+							entry_timeout->handler(entry_timeout->param, sloop.sloop_data);
+							BEAT_LEAVE();
+						}
+						/* 回调里没有重新启动或取消就将此定时器又归还给free_timeout双链表 */
+						if ((entry_timeout->flags & SLOOP_INUSED) && entry_timeout->list.next == NULL)
+							free_timeout(entry_timeout);
+					}
 				}
 			} else {
 				SLOOPDBG(d_info("sloop: timeout (0x%x) is gone, should be canceled !!!\n", entry_timeout));
@@ -483,9 +1394,13 @@ void sloop_run(void)
 			while (entry != &sloop.readers) {
 				/* dlist_entry函数通过list指针获得指向list所在结构体的指针 */
 				entry_socket = dlist_entry(entry, struct sloop_socket, list);
-				if (FD_ISSET(entry_socket->sock, &rfds))/* 读状态就绪执行回调函数 */
+				if (entry_socket->flags & SLOOP_MIGRATED)/* 已经交给别的loop */
+					res = -1;
+				else if (FD_ISSET(entry_socket->sock, &rfds)) {/* 读状态就绪执行回调函数 */
+					BEAT_ENTER(SLOOP_STALL_READ, entry_socket->sock, entry_socket->handler, entry_socket->param);
 					res = entry_socket->handler(entry_socket->sock, entry_socket->param, sloop.sloop_data);
-				else
+					BEAT_LEAVE();
+				} else
 					res = 0;
 				entry = entry->next;
 
@@ -502,9 +1417,13 @@ void sloop_run(void)
 			entry = sloop.writers.next;
 			while (entry != &sloop.writers) {
 				entry_socket = dlist_entry(entry, struct sloop_socket, list);
-				if (FD_ISSET(entry_socket->sock, &wfds))
+				if (entry_socket->flags & SLOOP_MIGRATED)
+					res = -1;
+				else if (FD_ISSET(entry_socket->sock, &wfds)) {
+					BEAT_ENTER(SLOOP_STALL_WRITE, entry_socket->sock, entry_socket->handler, entry_socket->param);
 					res = entry_socket->handler(entry_socket->sock, entry_socket->param, sloop.sloop_data);
-				else
+					BEAT_LEAVE();
+				} else
 					res = 0;
 				entry = entry->next;
 
@@ -514,19 +1433,1042 @@ void sloop_run(void)
 				}
 			}
 		}
+#if SLOOP_GROUP
+		/* 检查批量回调组: 就绪的成员收集到一个数组里, 一次回调 */
+		entry = sloop.groups.next;
+		while (entry != &sloop.groups) {
+			entry_group = dlist_entry(entry, struct sloop_group, list);
+			count = 0;
+			for (member = entry_group->members.next; member != &entry_group->members; member = member->next) {
+				entry_socket = dlist_entry(member, struct sloop_socket, list);
+				ret = 0;
+				if ((entry_socket->flags & SLOOP_MEMBER_READ) && FD_ISSET(entry_socket->sock, &rfds))
+					ret |= SLOOP_EVENT_READ;
+				if ((entry_socket->flags & SLOOP_MEMBER_WRITE) && FD_ISSET(entry_socket->sock, &wfds))
+					ret |= SLOOP_EVENT_WRITE;
+				if (ret) {
+					entry_group->events[count].sock = entry_socket->sock;
+					entry_group->events[count].events = ret;
+					entry_group->events[count].param = entry_socket->param;
+					count++;
+				}
+			}
+			res = 0;
+			if (count > 0) {
+				BEAT_ENTER(SLOOP_STALL_BATCH, count, entry_group->handler, entry_group->param);
+				res = entry_group->handler(entry_group->events, count, entry_group->param, sloop.sloop_data);
+				BEAT_LEAVE();
+			}
+			entry = entry->next;
+
+			if (res < 0) sloop_cancel_group(entry_group);
+		}
+#endif
+
+#if SLOOP_OUTPUT
+		/* 所有回调结束后, 每个有新数据的套接字只写一次, 没写完才监听可写 */
+		while (!dlist_empty(&sloop.dirty)) {
+			entry = sloop.dirty.next;
+			dlist_del(entry);
+			entry_output = dlist_entry(entry, struct sloop_output, dirty);
+			if (output_flush(entry_output) > 0) {
+				sloop.output_stats.partial++;
+				entry_output->wsock = register_socket(entry_output->sock, output_writable, entry_output, &sloop.writers);
+			}
+		}
+#endif
+
+#if SLOOP_MIGRATE
+		account_busy(&busy);
+#endif
 	}
+	sloop.dispatching = 0;
 	/* 在退出循环时要将所有的都归还给free_***结构体 */
+#if SLOOP_MIGRATE
+	close_channels();
+#endif
+#if SLOOP_PIDFD
+	sloop_cancel_pid(NULL);
+#endif
 	sloop_cancel_signal(NULL);
 	sloop_cancel_timeout(NULL);
+#if SLOOP_OUTPUT
+	sloop_output_close(NULL);
+#endif
+#if SLOOP_RING
+	/* eventfd的sloop_socket马上被归还, 通道本身留给调用者关闭 */
+	for (entry = sloop.rings.next; entry != &sloop.rings; entry = entry->next)
+		dlist_entry(entry, struct sloop_ring, list)->sock = NULL;
+#endif
 	sloop_cancel_read_sock(NULL);
 	sloop_cancel_write_sock(NULL);
+#if SLOOP_GROUP
+	sloop_cancel_group(NULL);
+#endif
+}
+
+#if SLOOP_PIDFD
+/* pidfd readable: the child is gone, reap exactly this pid */
+static int pidfd_handler(int sock, void * param, void * sloop_data)
+{
+	struct sloop_child * child = (struct sloop_child *)param;
+	sloop_exit_handler handler = child->handler;
+	void * user = child->param;
+	int pid = child->pid;
+	int status = -1;
+
+	/* 不是自己的子进程(sloop_watch_pid)时waitpid返回ECHILD, status为-1 */
+	if (waitpid(pid, &status, WNOHANG) == 0) return 0;
+
+	close(child->pidfd);
+	dlist_del(&child->list);
+	free_child(child);
+	SLOOPDBG(d_dbg("sloop: child %d exit, status=0x%x\n", pid, status));
+	if (handler) handler(pid, status, user, sloop_data);
+	return -1;//sloop_run归还pidfd的sloop_socket
+}
+
+static struct sloop_child * watch_pidfd(int pid, int pidfd, sloop_exit_handler handler, void * param)
+{
+	struct sloop_child * child;
+
+	child = get_child();
+	if (child == NULL) return NULL;
+
+	child->pid = pid;
+	child->pidfd = pidfd;
+	child->handler = handler;
+	child->param = param;
+	child->sock = register_socket(pidfd, pidfd_handler, child, &sloop.readers);
+	if (child->sock == NULL) {
+		free_child(child);
+		return NULL;
+	}
+	dlist_add(&child->list, &sloop.children);
+	return child;
+}
+
+/* start argv[0] (a path, no PATH lookup) and get a pidfd for it, with
+ * clone3(CLONE_PIDFD) when the kernel has it, else fork() + pidfd_open().
+ * envp == NULL inherits our environment. */
+static int spawn_pidfd(char * const argv[], char * const envp[], int * pid)
+{
+	extern char ** environ;
+	int pidfd = -1;
+#ifdef SYS_clone3
+	struct clone_args args;
+	long ret;
+
+	memset(&args, 0, sizeof(args));
+	args.flags = CLONE_PIDFD;
+	args.pidfd = (uint64_t)(uintptr_t)&pidfd;
+	args.exit_signal = SIGCHLD;
+	ret = syscall(SYS_clone3, &args, sizeof(args));
+	if (ret == 0) {
+		execve(argv[0], argv, envp ? envp : environ);
+		_exit(127);
+	}
+	if (ret > 0) {
+		*pid = ret;
+		return pidfd;
+	}
+	if (errno != ENOSYS) return -1;
+#endif
+	/* 子进程被waitpid之前pid不会被复用, fork之后再pidfd_open没有竞争 */
+	*pid = fork();
+	if (*pid == 0) {
+		execve(argv[0], argv, envp ? envp : environ);
+		_exit(127);
+	}
+	if (*pid < 0) return -1;
+	pidfd = syscall(SYS_pidfd_open, *pid, 0);
+	if (pidfd < 0) {
+		d_error("sloop: pidfd_open(%d) error %s\n", *pid, strerror(errno));
+		/* 没法监视它, 不能留下僵尸进程 */
+		kill(*pid, SIGKILL);
+		waitpid(*pid, NULL, 0);
+	}
+	return pidfd;
 }
 
+/* spawn a child and call 'handler' with its waitpid() status when it
+ * exits. No SIGCHLD handling is involved. */
+sloop_handle sloop_spawn(char * const argv[], char * const envp[], sloop_exit_handler handler, void * param)
+{
+	struct sloop_child * child;
+	int pid, pidfd;
+
+	if (dlist_empty(&sloop.free_children) || dlist_empty(&sloop.free_sockets)) {
+		d_error("sloop: no room to watch another child !!!\n");
+		return NULL;
+	}
+	pidfd = spawn_pidfd(argv, envp, &pid);
+	if (pidfd < 0) {
+		d_error("sloop: can not spawn %s: %s\n", argv[0], strerror(errno));
+		return NULL;
+	}
+	child = watch_pidfd(pid, pidfd, handler, param);
+	SLOOPDBG(d_dbg("sloop: spawn %s pid=%d pidfd=%d\n", argv[0], pid, pidfd));
+	return child;
+}
+
+/* watch an existing process. For our own children the exit status is
+ * reaped and delivered; for others 'status' is -1. */
+sloop_handle sloop_watch_pid(int pid, sloop_exit_handler handler, void * param)
+{
+	struct sloop_child * child;
+	int pidfd;
+
+	pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (pidfd < 0) {
+		d_error("sloop: pidfd_open(%d) error %s\n", pid, strerror(errno));
+		return NULL;
+	}
+	child = watch_pidfd(pid, pidfd, handler, param);
+	if (child == NULL) close(pidfd);
+	return child;
+}
+
+int sloop_pid(sloop_handle handle)
+{
+	return ((struct sloop_child *)handle)->pid;
+}
+
+/* stop watching a process (it is neither killed nor reaped) */
+void sloop_cancel_pid(sloop_handle handle)
+{
+	struct sloop_child * child = (struct sloop_child *)handle;
+
+	if (handle) {
+		cancel_socket(child->sock, &sloop.readers);
+		close(child->pidfd);
+		dlist_del(&child->list);
+		free_child(child);
+	} else {
+		while (!dlist_empty(&sloop.children))
+			sloop_cancel_pid(dlist_entry(sloop.children.next, struct sloop_child, list));
+	}
+}
+#endif
+
+#if SLOOP_MIGRATE
+/* open a channel into the calling thread's loop; hand the handle to
+ * exactly one other loop, which passes it to sloop_migrate(). */
+sloop_handle sloop_channel_open(void)
+{
+	struct sloop_channel * ch;
+	int i;
+
+	for (i = 0; i < MAX_SLOOP_CHANNEL; i++) {
+		ch = &_sloop_channels[i];
+		if (__sync_bool_compare_and_swap(&ch->inuse, 0, 1)) break;
+	}
+	if (i == MAX_SLOOP_CHANNEL) {
+		d_error("sloop: no sloop_channel available !!!\n");
+		return NULL;
+	}
+
+	ch->head = ch->tail = 0;
+	ch->dst = &sloop;
+	ch->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ch->efd < 0) {
+		d_error("sloop: eventfd error %s\n", strerror(errno));
+		ch->inuse = 0;
+		return NULL;
+	}
+	ch->sock = register_socket(ch->efd, channel_handler, ch, &sloop.readers);
+	if (ch->sock == NULL) {
+		close(ch->efd);
+		ch->inuse = 0;
+		return NULL;
+	}
+	return ch;
+}
+
+/* close a channel from its destination loop. Sockets still in flight are
+ * registered here; the slot is never reused, so later sloop_migrate()
+ * calls with this handle fail. sloop_run()
+ * closes the channels into its loop when it exits, closing the sockets
+ * still in flight since nobody would handle them. */
+void sloop_channel_close(sloop_handle handle)
+{
+	struct sloop_channel * ch = (struct sloop_channel *)handle;
+
+	if (ch->inuse != 1 || ch->dst != &sloop) return;
+	close_channel(ch, 1);
+}
+
+/* move a read or write registration of this loop to the channel's loop.
+ * It is never dispatched here again (it may be called from its own
+ * handler) and the destination registers the same sock/handler/param.
+ * select() is level triggered, so pending readiness is seen there. */
+int sloop_migrate(sloop_handle handle, sloop_handle channel)
+{
+	struct sloop_socket * entry = (struct sloop_socket *)handle;
+	struct sloop_channel * ch = (struct sloop_channel *)channel;
+	struct sloop_migration * m;
+	struct sloop_data * dst;
+	uint64_t one = 1;
+	unsigned int head;
+
+	if (!(entry->flags & SLOOP_INUSED) || (entry->flags & SLOOP_MIGRATED)) return -1;
+	if (entry->flags & (SLOOP_MEMBER_READ | SLOOP_MEMBER_WRITE)) return -1;
+
+	/* 和close_channel配对: 要么这里看到dst为NULL, 要么关闭方等到users为0 */
+	__atomic_add_fetch(&ch->users, 1, __ATOMIC_SEQ_CST);
+	dst = __atomic_load_n(&ch->dst, __ATOMIC_SEQ_CST);
+	if (ch->inuse != 1 || dst == NULL || dst == &sloop) {
+		__atomic_sub_fetch(&ch->users, 1, __ATOMIC_SEQ_CST);
+		return -1;
+	}
+
+	head = ch->head;
+	if (head - __atomic_load_n(&ch->tail, __ATOMIC_ACQUIRE) >= SLOOP_CHANNEL_SIZE) {
+		d_error("sloop: channel full, fd=%d stays !!!\n", entry->sock);
+		__atomic_sub_fetch(&ch->users, 1, __ATOMIC_SEQ_CST);
+		return -1;
+	}
+	m = &ch->ring[head & (SLOOP_CHANNEL_SIZE - 1)];
+	m->sock = entry->sock;
+	m->write = (entry->flags & SLOOP_WRITER) ? 1 : 0;
+	m->handler = entry->handler;
+	m->param = entry->param;
+
+	/* 先在这边摘掉, 再让目的loop看到 */
+	entry->flags |= SLOOP_MIGRATED;
+	__atomic_store_n(&ch->head, head + 1, __ATOMIC_RELEASE);
+	if (write(ch->efd, &one, sizeof(one)) < 0)
+		d_error("sloop: channel notify error %s\n", strerror(errno));
+	__atomic_sub_fetch(&ch->users, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+/* busy usecs per second of the calling thread's loop */
+unsigned long sloop_load(void)
+{
+	return sloop.load;
+}
+
+unsigned long sloop_channel_load(sloop_handle channel)
+{
+	struct sloop_data * dst = ((struct sloop_channel *)channel)->dst;
+
+	return dst ? dst->load : (unsigned long)-1;
+}
+
+/* least-loaded policy: move 'handle' to the least busy loop among
+ * 'channels' if that loop is less busy than this one. Returns the index
+ * of the channel used, -1 if the socket stays. */
+int sloop_migrate_balance(sloop_handle handle, sloop_handle * channels, int count)
+{
+	unsigned long load, best_load = sloop.load;
+	int i, best = -1;
+
+	for (i = 0; i < count; i++) {
+		load = sloop_channel_load(channels[i]);
+		if (load < best_load) {
+			best_load = load;
+			best = i;
+		}
+	}
+	if (best < 0 || sloop_migrate(handle, channels[best]) < 0) return -1;
+	return best;
+}
+#endif
+
+#if SLOOP_RING
+static struct sloop_ring * map_ring(int memfd, int efd, size_t maplen)
+{
+	struct sloop_ring * ring;
+	void * shm;
+
+	ring = get_ring();
+	if (ring == NULL) return NULL;
+
+	shm = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (shm == MAP_FAILED) {
+		d_error("sloop: ring mmap error %s\n", strerror(errno));
+		free_ring(ring);
+		return NULL;
+	}
+	ring->memfd = memfd;
+	ring->efd = efd;
+	ring->shm = (struct sloop_ring_shm *)shm;
+	ring->maplen = maplen;
+	ring->size = 0;
+	ring->broken = 0;
+	ring->sock = NULL;
+	ring->held = 0;
+	ring->handler = NULL;
+	ring->param = NULL;
+	dlist_add(&ring->list, &sloop.rings);
+	return ring;
+}
+
+/* create a shared-memory SPSC ring with at least 'size' bytes of data
+ * (rounded up to a power of 2). A message takes its length + 4 bytes,
+ * rounded up to 8, and may use at most half of the ring, so that it
+ * always fits contiguously once the ring is empty. Pass the fds from sloop_ring_fds() to
+ * the peer (fork() or SCM_RIGHTS), which calls sloop_ring_attach(). */
+sloop_handle sloop_ring_create(unsigned int size)
+{
+	struct sloop_ring * ring;
+	unsigned int n;
+	size_t maplen;
+	int memfd, efd;
+
+	for (n = 4096; n < size; n <<= 1);
+	maplen = sizeof(struct sloop_ring_shm) + n;
+
+	memfd = syscall(SYS_memfd_create, "sloop_ring", 0);
+	if (memfd < 0) {
+		d_error("sloop: memfd_create error %s\n", strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(memfd, maplen) < 0) {
+		d_error("sloop: ring ftruncate error %s\n", strerror(errno));
+		close(memfd);
+		return NULL;
+	}
+	efd = eventfd(0, EFD_NONBLOCK);
+	if (efd < 0) {
+		d_error("sloop: eventfd error %s\n", strerror(errno));
+		close(memfd);
+		return NULL;
+	}
+
+	ring = map_ring(memfd, efd, maplen);
+	if (ring == NULL) {
+		close(memfd);
+		close(efd);
+		return NULL;
+	}
+	ring->size = ring->shm->size = n;
+	ring->shm->head = ring->shm->tail = 0;
+	return ring;
+}
+
+/* attach to a ring created by the peer */
+sloop_handle sloop_ring_attach(int memfd, int efd)
+{
+	struct sloop_ring * ring;
+	struct stat st;
+	unsigned int size;
+
+	if (fstat(memfd, &st) < 0 || st.st_size <= (off_t)sizeof(struct sloop_ring_shm)) {
+		d_error("sloop: not a sloop ring (fd=%d)\n", memfd);
+		return NULL;
+	}
+	ring = map_ring(memfd, efd, st.st_size);
+	if (ring == NULL) return NULL;
+	/* 只读这一次, 之后都用ring->size */
+	size = ring->shm->size;
+	if (size < 4096 || (size & (size - 1)) || sizeof(struct sloop_ring_shm) + size > (size_t)st.st_size) {
+		d_error("sloop: ring (fd=%d) has a bad size %u\n", memfd, size);
+		sloop_ring_close(ring);
+		return NULL;
+	}
+	ring->size = size;
+	return ring;
+}
+
+void sloop_ring_fds(sloop_handle handle, int * memfd, int * efd)
+{
+	*memfd = ((struct sloop_ring *)handle)->memfd;
+	*efd = ((struct sloop_ring *)handle)->efd;
+}
+
+/* the peer wrote something impossible into the shared memory: stop using
+ * the ring, the doorbell handler unregisters itself on its next call */
+static void ring_broken(struct sloop_ring * ring)
+{
+	d_error("sloop: ring (fd=%d) is corrupted, stopped !!!\n", ring->memfd);
+	ring->broken = 1;
+}
+
+/* producer: copy one message into the ring, -1/EAGAIN when it is full,
+ * -1/EMSGSIZE when it is larger than half the ring (see sloop_ring_create),
+ * -1/EPROTO once the ring is found corrupted.
+ * The doorbell is only rung when the consumer had taken everything
+ * before it, i.e. when the ring goes from empty to non-empty. */
+int sloop_ring_send(sloop_handle handle, const void * msg, unsigned int len)
+{
+	struct sloop_ring * ring = (struct sloop_ring *)handle;
+	struct sloop_ring_shm * shm = ring->shm;
+	unsigned int size = ring->size;
+	unsigned int head, old, tail, pos, need, skip = 0;
+	uint64_t one = 1;
+
+	/* 需要跳到开头时skip < need, 不超过一半才能保证空队列一定放得下 */
+	need = RING_ALIGN(sizeof(unsigned int) + len);
+	if (len > size || need > size / 2) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (ring->broken) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	old = head = shm->head;
+	tail = __atomic_load_n(&shm->tail, __ATOMIC_ACQUIRE);
+	if (head - tail > size || (head & 7)) {
+		ring_broken(ring);
+		errno = EPROTO;
+		return -1;
+	}
+	pos = head & (size - 1);
+	/* 消息要连续存放才能原地读, 尾部放不下就跳到开头 */
+	if (size - pos < need) skip = size - pos;
+	if (head + skip + need - tail > size) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (skip) {
+		*(unsigned int *)(shm->data + pos) = RING_SKIP;
+		head += skip;
+		pos = 0;
+	}
+	*(unsigned int *)(shm->data + pos) = len;
+	memcpy(shm->data + pos + sizeof(unsigned int), msg, len);
+	__atomic_store_n(&shm->head, head + need, __ATOMIC_RELEASE);
+
+	/* 和消费者的'写tail再读head'配对, 两边至少有一边看到对方 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&shm->tail, __ATOMIC_RELAXED) == old) {
+		if (write(ring->efd, &one, sizeof(one)) < 0)
+			d_error("sloop: ring doorbell error %s\n", strerror(errno));
+	}
+	return len;
+}
+
+/* consumer: find the oldest message, skipping wrap markers. Everything
+ * read from the shared memory is checked against ring->size before use;
+ * returns NULL when the ring is empty or was just found corrupted. */
+static const char * ring_front(struct sloop_ring * ring, unsigned int * ptail, unsigned int * len)
+{
+	struct sloop_ring_shm * shm = ring->shm;
+	unsigned int size = ring->size;
+	unsigned int head, tail, pos, n;
+
+	if (ring->broken) return NULL;
+	tail = shm->tail;
+	head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+	while (tail != head) {
+		if (head - tail > size || (tail & 7)) break;
+		pos = tail & (size - 1);
+		n = *(volatile unsigned int *)(shm->data + pos);
+		if (n != RING_SKIP) {
+			if (n > size / 2 || pos + sizeof(unsigned int) + n > size ||
+			    RING_ALIGN(sizeof(unsigned int) + n) > head - tail) break;
+			*ptail = tail;
+			*len = n;
+			return shm->data + pos + sizeof(unsigned int);
+		}
+		if (size - pos > head - tail) break;
+		tail += size - pos;
+		__atomic_store_n(&shm->tail, tail, __ATOMIC_RELEASE);
+	}
+	if (tail != head) ring_broken(ring);
+	return NULL;
+}
+
+/* consumer: the oldest message, in place; stays valid until released.
+ * NULL when the ring is empty, or with errno EPROTO once it is found
+ * corrupted, which stops the ring. */
+const void * sloop_ring_peek(sloop_handle handle, unsigned int * len)
+{
+	struct sloop_ring * ring = (struct sloop_ring *)handle;
+	const char * msg;
+	unsigned int tail;
+
+	msg = ring_front(ring, &tail, len);
+	if (msg == NULL && ring->broken) errno = EPROTO;
+	return msg;
+}
+
+/* give the oldest message's space back to the producer, returns 1 if
+ * more messages are waiting, -1 if the ring is corrupted. */
+static int ring_release(struct sloop_ring * ring)
+{
+	struct sloop_ring_shm * shm = ring->shm;
+	unsigned int tail, len;
+
+	if (ring_front(ring, &tail, &len) == NULL) return ring->broken ? -1 : 0;
+	tail += RING_ALIGN(sizeof(unsigned int) + len);
+	__atomic_store_n(&shm->tail, tail, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&shm->head, __ATOMIC_RELAXED) != tail;
+}
+
+/* release the message returned by sloop_ring_peek() (or kept by a
+ * handler returning > 0); dispatch resumes if more are waiting. */
+void sloop_ring_release(sloop_handle handle)
+{
+	struct sloop_ring * ring = (struct sloop_ring *)handle;
+	uint64_t one = 1;
+
+	/* 生产者看到的不是空队列, 不会按门铃, 自己按一下 */
+	if (ring_release(ring) > 0 && ring->held && ring->sock) {
+		if (write(ring->efd, &one, sizeof(one)) < 0)
+			d_error("sloop: ring doorbell error %s\n", strerror(errno));
+	}
+	ring->held = 0;
+}
+
+/* doorbell: hand every waiting message to the handler in place */
+static int ring_doorbell(int sock, void * param, void * sloop_data)
+{
+	struct sloop_ring * ring = (struct sloop_ring *)param;
+	const void * msg;
+	unsigned int len;
+	uint64_t count;
+	int res;
+
+	if (read(sock, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		d_error("sloop: ring doorbell read error %s\n", strerror(errno));
+	if (ring->held && !ring->broken) return 0;
+
+	while ((msg = sloop_ring_peek(ring, &len)) != NULL) {
+		res = ring->handler(msg, len, ring->param, sloop_data);
+		if (res > 0) {
+			/* 回调要继续用这条消息, 等它调用sloop_ring_release */
+			ring->held = 1;
+			return 0;
+		}
+		if (ring_release(ring) < 0 || res < 0) break;
+	}
+	if (ring->broken || msg != NULL) {
+		ring->sock = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* consumer: watch the doorbell in this loop. 'handler' gets each message
+ * in place; return 0 to release it, > 0 to keep it until
+ * sloop_ring_release(), < 0 to stop listening. */
+sloop_handle sloop_ring_listen(sloop_handle handle, sloop_ring_handler handler, void * param)
+{
+	struct sloop_ring * ring = (struct sloop_ring *)handle;
+	uint64_t one = 1;
+
+	ring->handler = handler;
+	ring->param = param;
+	ring->sock = register_socket(ring->efd, ring_doorbell, ring, &sloop.readers);
+	if (ring->sock == NULL) return NULL;
+	/* 开始监听前已经有的消息不会再按门铃 */
+	if (write(ring->efd, &one, sizeof(one)) < 0)
+		d_error("sloop: ring doorbell error %s\n", strerror(errno));
+	return ring->sock;
+}
+
+/* unmap the ring and close its fds, NULL for all */
+void sloop_ring_close(sloop_handle handle)
+{
+	struct sloop_ring * ring = (struct sloop_ring *)handle;
+
+	if (handle) {
+		if (ring->sock) cancel_socket(ring->sock, &sloop.readers);
+		munmap(ring->shm, ring->maplen);
+		close(ring->memfd);
+		close(ring->efd);
+		dlist_del(&ring->list);
+		free_ring(ring);
+	} else {
+		while (!dlist_empty(&sloop.rings))
+			sloop_ring_close(dlist_entry(sloop.rings.next, struct sloop_ring, list));
+	}
+}
+#endif
+
 void sloop_terminate(void)
 {
 	sloop.terminate = 1;
 }
 
+/* current loop time, virtual in simulation mode */
+void sloop_now(struct timeval * tv)
+{
+	sloop_gettime(tv);
+}
+
+/* switch the loop to a virtual clock starting at 'start_secs'. select()
+ * is no longer called: the loop only sees fds and signals injected with
+ * sloop_sim_inject_fd()/sloop_sim_inject_signal(), and when nothing is
+ * injected the clock jumps to the next timer. sloop_run() returns once
+ * there is neither. Call right after sloop_init(). */
+void sloop_sim_enable(unsigned long start_secs)
+{
+	sloop.sim.enabled = 1;
+	sloop.sim.now.tv_sec = start_secs;
+	sloop.sim.now.tv_usec = 0;
+	sloop.now = sloop.sim.now;
+	FD_ZERO(&sloop.sim.rfds);
+	FD_ZERO(&sloop.sim.wfds);
+	sloop.sim.signals = 0;
+}
+
+/* make 'sock' readable and/or writable for the next loop iteration */
+void sloop_sim_inject_fd(int sock, int readable, int writable)
+{
+	if (sock < 0 || sock >= FD_SETSIZE) return;
+	if (readable) FD_SET(sock, &sloop.sim.rfds);
+	if (writable) FD_SET(sock, &sloop.sim.wfds);
+}
+
+/* deliver 'sig' to its sloop_register_signal() handler, as if raised */
+void sloop_sim_inject_signal(int sig)
+{
+	if (write(sloop.signal_pipe[1], &sig, sizeof(sig)) < 0) {
+		d_error("sloop: sloop_sim_inject_signal(): Cound not send signal: %s\n", strerror(errno));
+		return;
+	}
+	sloop.sim.signals++;
+}
+
+/* move the virtual clock forward, timers are run on the next iteration */
+void sloop_sim_advance(unsigned int secs, unsigned int usecs)
+{
+	set_deadline(&sloop.sim.now, &sloop.sim.now, secs, usecs);
+	sloop.now = sloop.sim.now;
+}
+
+/* enable busy-poll: spin for up to 'usecs' before blocking, 0 to disable */
+void sloop_set_busy_poll(unsigned int usecs)
+{
+	sloop.busy_budget = usecs;
+	sloop.busy.window = usecs;
+}
+
+void sloop_get_busy_poll_stats(struct sloop_busy_poll_stats * stats)
+{
+	*stats = sloop.busy;
+}
+
+#if SLOOP_WATCHDOG
+/* runs on the loop thread when the watchdog asks for a backtrace */
+static void watchdog_signal_handler(int sig)
+{
+	struct sloop_stall * stall = wd.capture;
+
+	/* 回调已经返回了, 现在的栈不是卡住的那个, 不抓 */
+	if (stall && wd.beat->seq == wd.capture_seq)
+		stall->nframes = backtrace(stall->frames, SLOOP_STALL_FRAMES);
+	wd.capture = NULL;
+}
+
+static void * watchdog_thread(void * arg)
+{
+	struct sloop_beat * beat = wd.beat;
+	struct sloop_stall * stall;
+	struct timeval now, start;
+	unsigned long seq, iteration, elapsed;
+	unsigned long period;
+	int type, id;
+	void * handler, * param;
+
+	/* 检查周期取阈值的1/4, 最少1ms */
+	period = wd.threshold / 4;
+	if (period < 1000) period = 1000;
+
+	while (wd.running) {
+		usleep(period);
+
+		/* 取一份一致的快照, seq为偶数表示sloop_run不在回调里 */
+		seq = beat->seq;
+		if (!(seq & 1)) continue;
+		__sync_synchronize();
+		type = beat->type;
+		id = beat->id;
+		handler = beat->handler;
+		param = beat->param;
+		iteration = beat->iteration;
+		start = beat->start;
+		__sync_synchronize();
+		if (beat->seq != seq) continue;
+
+		gettimeofday(&now, NULL);
+		timersub(&now, &start, &now);
+		elapsed = now.tv_sec * 1000000 + now.tv_usec;
+		if (elapsed < wd.threshold) continue;
+
+		pthread_mutex_lock(&wd.lock);
+		if (seq != wd.last_seq) {
+			/* 新的卡顿 */
+			stall = &wd.log[wd.count % MAX_SLOOP_STALL];
+			memset(stall, 0, sizeof(*stall));
+			stall->type = type;
+			stall->id = id;
+			stall->handler = handler;
+			stall->param = param;
+			stall->iteration = iteration;
+			stall->usecs = elapsed;
+			wd.last_seq = seq;
+			wd.count++;
+			d_warn("sloop: watchdog: handler(0x%p) type(%d) id(%d) stalled for %lu usecs\n",
+			       handler, type, id, elapsed);
+			if (wd.backtrace) {
+				wd.capture_seq = seq;
+				__sync_synchronize();
+				wd.capture = stall;
+				pthread_kill(wd.loop, SLOOP_WATCHDOG_SIGNAL);
+			}
+		} else {
+			/* 还在同一个回调里, 更新持续时间 */
+			stall = &wd.log[(wd.count - 1) % MAX_SLOOP_STALL];
+			stall->usecs = elapsed;
+		}
+		pthread_mutex_unlock(&wd.lock);
+	}
+	return NULL;
+}
+
+/* start the stall watchdog for the loop running in the calling thread.
+ * Any handler running longer than 'threshold_ms' is logged; with
+ * 'with_backtrace' set the loop thread's stack is captured as well, by
+ * signalling it: a stalled handler blocked in a non-restartable call
+ * (nanosleep, poll, select, timed recv) sees EINTR. See sloop.h. */
+int sloop_watchdog_start(unsigned int threshold_ms, int with_backtrace)
+{
+	struct sigaction sa;
+	void * frame;
+
+	if (wd.running) return -1;
+
+	wd.loop = pthread_self();
+	wd.beat = &sloop.beat;
+	wd.threshold = (unsigned long)threshold_ms * 1000;
+	wd.backtrace = with_backtrace;
+	wd.last_seq = sloop.beat.seq;
+	wd.capture = NULL;
+
+	if (with_backtrace) {
+		/* backtrace()第一次调用时会加载libgcc, 不能放在信号处理函数里做 */
+		backtrace(&frame, 1);
+		sa.sa_handler = watchdog_signal_handler;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_RESTART;
+		if (sigaction(SLOOP_WATCHDOG_SIGNAL, &sa, NULL) < 0) {
+			d_error("sloop: watchdog sigaction error %s\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	wd.running = 1;
+	if (pthread_create(&wd.thread, NULL, watchdog_thread, NULL) != 0) {
+		wd.running = 0;
+		d_error("sloop: can not start watchdog thread !!!\n");
+		return -1;
+	}
+	return 0;
+}
+
+void sloop_watchdog_stop(void)
+{
+	if (!wd.running) return;
+	wd.running = 0;
+	pthread_join(wd.thread, NULL);
+	if (wd.backtrace) signal(SLOOP_WATCHDOG_SIGNAL, SIG_DFL);
+}
+
+/* copy up to 'max' of the most recent stalls, oldest first */
+int sloop_watchdog_log(struct sloop_stall * log, int max)
+{
+	unsigned int i, n;
+
+	pthread_mutex_lock(&wd.lock);
+	n = wd.count < MAX_SLOOP_STALL ? wd.count : MAX_SLOOP_STALL;
+	if (n > (unsigned int)max) n = max;
+	for (i = 0; i < n; i++)
+		log[i] = wd.log[(wd.count - n + i) % MAX_SLOOP_STALL];
+	pthread_mutex_unlock(&wd.lock);
+	return n;
+}
+#endif
+
+#if SLOOP_HANDOFF
+/* new process connects: send it every registered listening socket,
+ * then stop watching them here and let the caller drain. */
+static int handoff_accept(int sock, void * param, void * sloop_data)
+{
+	struct sloop_socket * listeners[MAX_SLOOP_SOCKET];
+	int fds[MAX_SLOOP_SOCKET];
+	struct sloop_socket * entry_socket;
+	struct dlist_head * entry;
+	struct msghdr msg;
+	struct cmsghdr * cmsg;
+	struct iovec iov;
+	char buf[CMSG_SPACE(sizeof(int) * MAX_SLOOP_SOCKET)];
+	socklen_t len;
+	int conn, n, i, on;
+
+	conn = accept(sock, NULL, NULL);
+	if (conn < 0) {
+		d_error("sloop: handoff accept error %s\n", strerror(errno));
+		return 0;
+	}
+
+	/* 找出所有监听状态的读套接字 */
+	n = 0;
+	for (entry = sloop.readers.next; entry != &sloop.readers; entry = entry->next) {
+		entry_socket = dlist_entry(entry, struct sloop_socket, list);
+		len = sizeof(on);
+		if (entry_socket->sock == sock) continue;
+		if (getsockopt(entry_socket->sock, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) < 0 || !on) continue;
+		listeners[n++] = entry_socket;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &n;
+	iov.iov_len = sizeof(n);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (n > 0) {
+		msg.msg_control = buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+		for (i = 0; i < n; i++)
+			((int *)CMSG_DATA(cmsg))[i] = listeners[i]->sock;
+	}
+	if (sendmsg(conn, &msg, 0) < 0) {
+		d_error("sloop: handoff sendmsg error %s\n", strerror(errno));
+		close(conn);
+		return 0;
+	}
+	close(conn);
+
+	/* 新进程已经接手, 这里不再accept; 这些sloop_handle从此失效 */
+	for (i = 0; i < n; i++) {
+		SLOOPDBG(d_dbg("sloop: handoff listener fd=%d\n", listeners[i]->sock));
+		fds[i] = listeners[i]->sock;
+		cancel_socket(listeners[i], &sloop.readers);
+	}
+	close(sock);
+	unlink(sloop.handoff.path);
+	if (sloop.handoff.handler)
+		sloop.handoff.handler(fds, n, sloop.handoff.param, sloop_data);
+	return -1;
+}
+
+/* old process: wait on unix socket 'path' for a successor to take over
+ * the listening sockets. Their read registrations are cancelled here, so
+ * any sloop_handle saved for them is invalid once 'handler' runs and must
+ * not be cancelled again. 'handler' gets the fds handed over (still open
+ * in this process, close them when done); the caller then drains its
+ * connections and exits. */
+sloop_handle sloop_handoff_serve(const char * path, sloop_handoff_handler handler, void * param)
+{
+	struct sockaddr_un addr;
+	struct sloop_socket * entry;
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) return NULL;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) return NULL;
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 1) < 0) {
+		d_error("sloop: handoff bind %s error %s\n", path, strerror(errno));
+		close(sock);
+		return NULL;
+	}
+
+	entry = register_socket(sock, handoff_accept, NULL, &sloop.readers);
+	if (entry == NULL) {
+		close(sock);
+		unlink(path);
+		return NULL;
+	}
+	strcpy(sloop.handoff.path, path);
+	sloop.handoff.handler = handler;
+	sloop.handoff.param = param;
+	return entry;
+}
+
+/* new process: fetch the listening sockets of the process serving 'path'.
+ * Returns how many were received, -1 if nobody is serving (fresh start).
+ * Claim them with sloop_handoff_listener(). */
+int sloop_handoff_adopt(const char * path)
+{
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr * cmsg;
+	struct iovec iov;
+	char buf[CMSG_SPACE(sizeof(int) * MAX_SLOOP_SOCKET)];
+	int sock, n, i;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) return -1;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		SLOOPDBG(d_info("sloop: no handoff server on %s\n", path));
+		close(sock);
+		return -1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &n;
+	iov.iov_len = sizeof(n);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = buf;
+	msg.msg_controllen = sizeof(buf);
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+		d_error("sloop: handoff recvmsg error %s\n", strerror(errno));
+		close(sock);
+		return -1;
+	}
+	close(sock);
+
+	sloop.handoff.count = 0;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < n && sloop.handoff.count < MAX_SLOOP_SOCKET; i++)
+			sloop.handoff.fds[sloop.handoff.count++] = ((int *)CMSG_DATA(cmsg))[i];
+	}
+	return sloop.handoff.count;
+}
+
+/* claim the adopted listening socket bound to 'addr', -1 if there is none
+ * and the caller has to create it. */
+int sloop_handoff_listener(const struct sockaddr * addr, unsigned int addrlen)
+{
+	struct sockaddr_storage local;
+	socklen_t len;
+	int i, sock;
+
+	for (i = 0; i < sloop.handoff.count; i++) {
+		len = sizeof(local);
+		memset(&local, 0, sizeof(local));
+		if (getsockname(sloop.handoff.fds[i], (struct sockaddr *)&local, &len) < 0) continue;
+		if (len != addrlen || memcmp(&local, addr, len)) continue;
+		sock = sloop.handoff.fds[i];
+		sloop.handoff.fds[i] = sloop.handoff.fds[--sloop.handoff.count];
+		return sock;
+	}
+	return -1;
+}
+
+/* close adopted listening sockets nobody claimed */
+void sloop_handoff_release(void)
+{
+	while (sloop.handoff.count > 0)
+		close(sloop.handoff.fds[--sloop.handoff.count]);
+}
+#endif
+
 static void sloop_dump_socket(struct dlist_head * head)
 {
 	struct dlist_head * entry;
@@ -568,6 +2510,8 @@ void sloop_dump_timeout(void)
 		printf("timeout(0x%p), time(%d:%d), param(0x%p), handler(0x%p)\n",
 		       timeout, (int)timeout->time.tv_sec, (int)timeout->time.tv_usec,
 		       timeout->param, timeout->handler);
+		if (timeout->flags & SLOOP_LAZY)
+			printf("  lazy(%d:%d)\n", (int)timeout->lazy.tv_sec, (int)timeout->lazy.tv_usec);
 		entry = entry->next;
 	}
 	printf("---------------------------------\n");
@@ -591,12 +2535,60 @@ void sloop_dump_signals(void)
 	printf("---------------------------------\n");
 }
 
+#if SLOOP_GROUP
+void sloop_dump_groups(void)
+{
+	struct dlist_head * entry;
+	struct sloop_group * group;
+
+	printf("=================================\n");
+	printf("sloop groups\n");
+	entry = sloop.groups.next;
+	while (entry != &sloop.groups) {
+		group = dlist_entry(entry, struct sloop_group, list);
+		printf("group(0x%p), param(0x%p), handler(0x%p)\n",
+		       group, group->param, group->handler);
+		sloop_dump_socket(&group->members);
+		entry = entry->next;
+	}
+	printf("---------------------------------\n");
+}
+#endif
+
+#if SLOOP_WATCHDOG
+void sloop_dump_watchdog(void)
+{
+	struct sloop_stall log[MAX_SLOOP_STALL];
+	int i, n;
+
+	printf("=================================\n");
+	printf("sloop watchdog\n");
+	n = sloop_watchdog_log(log, MAX_SLOOP_STALL);
+	for (i = 0; i < n; i++) {
+		printf("stall type(%d), id(%d), handler(0x%p), param(0x%p), iteration(%lu), usecs(%lu)\n",
+		       log[i].type, log[i].id, log[i].handler, log[i].param,
+		       log[i].iteration, log[i].usecs);
+		if (log[i].nframes > 0) {
+			fflush(stdout);
+			backtrace_symbols_fd(log[i].frames, log[i].nframes, STDOUT_FILENO);
+		}
+	}
+	printf("---------------------------------\n");
+}
+#endif
+
 void sloop_dump(void)
 {
 	sloop_dump_readers();
 	sloop_dump_writers();
 	sloop_dump_timeout();
 	sloop_dump_signals();
+#if SLOOP_GROUP
+	sloop_dump_groups();
+#endif
+#if SLOOP_WATCHDOG
+	sloop_dump_watchdog();
+#endif
 }
 
 #if 0
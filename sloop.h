@@ -22,13 +22,128 @@ extern "C" {
 #ifndef MAX_SLOOP_TIMEOUT
 #define MAX_SLOOP_TIMEOUT	128
 #endif
+#ifndef SLOOP_GROUP
+#define SLOOP_GROUP			0		/* batch handler groups */
+#endif
+#ifndef MAX_SLOOP_GROUP
+#define MAX_SLOOP_GROUP		4
+#endif
+#ifndef SLOOP_OUTPUT
+#define SLOOP_OUTPUT		0		/* pending-output queues flushed once per iteration */
+#endif
+#ifndef MAX_SLOOP_OUTPUT
+#define MAX_SLOOP_OUTPUT	16
+#endif
+#ifndef SLOOP_OUTPUT_SIZE
+#define SLOOP_OUTPUT_SIZE	16384	/* per socket, must be a power of 2 */
+#endif
+#ifndef SLOOP_WATCHDOG
+#define SLOOP_WATCHDOG		0		/* stall watchdog thread, link with -lpthread */
+#endif
+#ifndef MAX_SLOOP_STALL
+#define MAX_SLOOP_STALL		16
+#endif
+#ifndef SLOOP_STALL_FRAMES
+#define SLOOP_STALL_FRAMES	16
+#endif
+#ifndef SLOOP_HANDOFF
+#define SLOOP_HANDOFF		0		/* listening socket handoff between processes */
+#endif
+#ifndef SLOOP_PIDFD
+#define SLOOP_PIDFD			0		/* child supervision through pidfd, Linux >= 5.3 */
+#endif
+#ifndef MAX_SLOOP_CHILD
+#define MAX_SLOOP_CHILD		32
+#endif
+#ifndef SLOOP_MIGRATE
+#define SLOOP_MIGRATE		0		/* one loop per thread, migrate sockets between them */
+#endif
+#ifndef MAX_SLOOP_CHANNEL
+#define MAX_SLOOP_CHANNEL	16		/* channels opened per process, closed slots are not reused */
+#endif
+#ifndef SLOOP_CHANNEL_SIZE
+#define SLOOP_CHANNEL_SIZE	64		/* must be a power of 2 */
+#endif
+#ifndef SLOOP_RING
+#define SLOOP_RING			0		/* shared-memory ring channel between processes, Linux */
+#endif
+#ifndef MAX_SLOOP_RING
+#define MAX_SLOOP_RING		8
+#endif
+#ifndef SLOOP_BUSY_POLL_MIN
+#define SLOOP_BUSY_POLL_MIN	8		/* smallest adaptive spin window (usecs) */
+#endif
 
 typedef void * sloop_handle;
+struct timeval;
 
 typedef int (*sloop_socket_handler)(int sock, void * param, void * sloop_data);
 typedef int (*sloop_signal_handler)(int sig, void * param, void * sloop_data);
 typedef void (*sloop_timeout_handler)(void * param, void * sloop_data);
 
+#if SLOOP_GROUP
+/* a ready member of a batch group */
+#define SLOOP_EVENT_READ	1
+#define SLOOP_EVENT_WRITE	2
+struct sloop_event {
+	int sock;
+	int events;				/* SLOOP_EVENT_xxx */
+	void * param;			/* member's param */
+};
+typedef int (*sloop_batch_handler)(struct sloop_event * events, int count, void * param, void * sloop_data);
+#endif
+#if SLOOP_RING
+typedef int (*sloop_ring_handler)(const void * msg, unsigned int len, void * param, void * sloop_data);
+#endif
+#if SLOOP_PIDFD
+typedef void (*sloop_exit_handler)(int pid, int status, void * param, void * sloop_data);
+#endif
+#if SLOOP_HANDOFF
+struct sockaddr;
+/* fds: listening sockets handed over, their sloop_handles are already cancelled */
+typedef void (*sloop_handoff_handler)(int * fds, int count, void * param, void * sloop_data);
+#endif
+
+#if SLOOP_OUTPUT
+/* pending-output statistics */
+struct sloop_output_stats {
+	unsigned long writes;		/* sloop_output_write() calls */
+	unsigned long syscalls;		/* writev() calls actually made */
+	unsigned long saved;		/* writes - syscalls */
+	unsigned long partial;		/* flushes that had to wait for writable */
+};
+#endif
+
+/* busy-poll statistics */
+struct sloop_busy_poll_stats {
+	unsigned long polls;		/* zero-timeout select() calls */
+	unsigned long hits;			/* spin windows that caught an event */
+	unsigned long misses;		/* spin windows that fell back to blocking */
+	unsigned long spin_usecs;	/* time burned spinning */
+	unsigned int window;		/* current spin window (usecs) */
+};
+
+#if SLOOP_WATCHDOG
+/* handler types reported by the watchdog */
+#define SLOOP_STALL_READ	1
+#define SLOOP_STALL_WRITE	2
+#define SLOOP_STALL_SIGNAL	3
+#define SLOOP_STALL_TIMEOUT	4
+#define SLOOP_STALL_BATCH	5	/* id is the number of ready members */
+
+/* a handler that blocked the loop */
+struct sloop_stall {
+	int type;				/* SLOOP_STALL_xxx */
+	int id;					/* fd or signal, -1 for timeouts */
+	void * handler;
+	void * param;
+	unsigned long iteration;/* loop iteration it happened in */
+	unsigned long usecs;	/* how long the handler ran (so far) */
+	int nframes;			/* backtrace depth, 0 if not captured */
+	void * frames[SLOOP_STALL_FRAMES];
+};
+#endif
+
 /* export functoin prototype */
 long sloop_uptime(void);
 void sloop_init(void * sloop_data);
@@ -38,16 +153,83 @@ sloop_handle sloop_register_signal(int sig, sloop_signal_handler handler, void *
 sloop_handle sloop_register_timeout(unsigned int secs, unsigned int usecs, sloop_timeout_handler handler, void * param);
 void sloop_cancel_read_sock(sloop_handle handle);
 void sloop_cancel_write_sock(sloop_handle handle);
+#if SLOOP_GROUP
+sloop_handle sloop_register_group(sloop_batch_handler handler, void * param);
+sloop_handle sloop_group_add(sloop_handle group, int sock, int events, void * param);
+void sloop_group_del(sloop_handle member);
+void sloop_cancel_group(sloop_handle handle);
+#endif
+#if SLOOP_OUTPUT
+sloop_handle sloop_output_open(int sock);
+int sloop_output_write(sloop_handle handle, const void * buf, unsigned int len);
+void sloop_output_close(sloop_handle handle);
+void sloop_get_output_stats(struct sloop_output_stats * stats);
+#endif
 void sloop_cancel_signal(sloop_handle handle);
 void sloop_cancel_timeout(sloop_handle handle);
+int sloop_timer_reset(sloop_handle handle, unsigned int secs, unsigned int usecs);
+int sloop_timer_reset_lazy(sloop_handle handle, unsigned int secs, unsigned int usecs);
 void sloop_run(void);
 void sloop_terminate(void);
+void sloop_now(struct timeval * tv);
+void sloop_sim_enable(unsigned long start_secs);
+void sloop_sim_inject_fd(int sock, int readable, int writable);
+void sloop_sim_inject_signal(int sig);
+void sloop_sim_advance(unsigned int secs, unsigned int usecs);
+void sloop_set_busy_poll(unsigned int usecs);
+void sloop_get_busy_poll_stats(struct sloop_busy_poll_stats * stats);
+#if SLOOP_RING
+sloop_handle sloop_ring_create(unsigned int size);
+sloop_handle sloop_ring_attach(int memfd, int efd);
+void sloop_ring_fds(sloop_handle ring, int * memfd, int * efd);
+int sloop_ring_send(sloop_handle ring, const void * msg, unsigned int len);
+sloop_handle sloop_ring_listen(sloop_handle ring, sloop_ring_handler handler, void * param);
+const void * sloop_ring_peek(sloop_handle ring, unsigned int * len);
+void sloop_ring_release(sloop_handle ring);
+void sloop_ring_close(sloop_handle ring);
+#endif
+#if SLOOP_PIDFD
+sloop_handle sloop_spawn(char * const argv[], char * const envp[], sloop_exit_handler handler, void * param);
+sloop_handle sloop_watch_pid(int pid, sloop_exit_handler handler, void * param);
+int sloop_pid(sloop_handle handle);
+void sloop_cancel_pid(sloop_handle handle);
+#endif
+#if SLOOP_MIGRATE
+sloop_handle sloop_channel_open(void);
+void sloop_channel_close(sloop_handle channel);
+int sloop_migrate(sloop_handle handle, sloop_handle channel);
+int sloop_migrate_balance(sloop_handle handle, sloop_handle * channels, int count);
+unsigned long sloop_load(void);
+unsigned long sloop_channel_load(sloop_handle channel);
+#endif
+#if SLOOP_HANDOFF
+sloop_handle sloop_handoff_serve(const char * path, sloop_handoff_handler handler, void * param);
+int sloop_handoff_adopt(const char * path);
+int sloop_handoff_listener(const struct sockaddr * addr, unsigned int addrlen);
+void sloop_handoff_release(void);
+#endif
+#if SLOOP_WATCHDOG
+/* with_backtrace: the stack is taken by sending SLOOP_WATCHDOG_SIGNAL
+ * (SIGPROF by default) to the loop thread while the handler is stalled.
+ * Non-restartable calls in that handler (nanosleep/usleep, poll, select,
+ * recv with SO_RCVTIMEO...) then return early with EINTR, so only enable
+ * it where handlers tolerate EINTR; 0 never signals the loop thread. */
+int sloop_watchdog_start(unsigned int threshold_ms, int with_backtrace);
+void sloop_watchdog_stop(void);
+int sloop_watchdog_log(struct sloop_stall * log, int max);
+#endif
 
 #if DEBUG_SLOOP_DUMP
 void sloop_dump_readers(void);
 void sloop_dump_writers(void);
 void sloop_dump_timeout(void);
 void sloop_dump_signals(void);
+#if SLOOP_GROUP
+void sloop_dump_groups(void);
+#endif
+#if SLOOP_WATCHDOG
+void sloop_dump_watchdog(void);
+#endif
 void sloop_dump(void);
 #endif
 